@@ -0,0 +1,257 @@
+// Allocator benchmark: replays the main.c access patterns plus a few
+// synthetic ones and reports throughput and per-call latency percentiles.
+//
+// Each workload runs twice on a fresh pool: once untimed to measure
+// throughput over the whole replay, and once with a clock read around every
+// call to collect latencies, so timer overhead never skews the ops/sec figure.
+//
+// Usage: ./bench [rounds] [pages]
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buddy.h"
+
+#define MAXRANK (16)
+#define DEFAULT_PAGES (128 * 1024 / 4)
+#define PAGE (1024 * 4)
+
+enum { API_ALLOC, API_RETURN, API_QUERY_COUNTS, API_QUERY_RANKS, API_COUNT };
+
+static const char *api_names[API_COUNT] = {
+    "alloc_pages", "return_pages", "query_page_counts", "query_ranks",
+};
+
+typedef struct {
+    uint32_t *samples;
+    long count;
+    long cap;
+} latency_t;
+
+static latency_t lat[API_COUNT];
+static int timed = 0;
+static long total_ops = 0;
+
+static void *pool;
+static int pages = DEFAULT_PAGES;
+static void **held;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record(int api, uint64_t ns) {
+    latency_t *l = &lat[api];
+    if (l->count == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 1 << 16;
+        l->samples = realloc(l->samples, l->cap * sizeof(uint32_t));
+        if (l->samples == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    l->samples[l->count++] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+}
+
+// Wrappers that count every call and time it on the timed pass
+static void *b_alloc(int rank) {
+    total_ops++;
+    if (!timed) return alloc_pages(rank);
+    uint64_t t0 = now_ns();
+    void *r = alloc_pages(rank);
+    record(API_ALLOC, now_ns() - t0);
+    return r;
+}
+
+static int b_return(void *p) {
+    total_ops++;
+    if (!timed) return return_pages(p);
+    uint64_t t0 = now_ns();
+    int r = return_pages(p);
+    record(API_RETURN, now_ns() - t0);
+    return r;
+}
+
+static int b_counts(int rank) {
+    total_ops++;
+    if (!timed) return query_page_counts(rank);
+    uint64_t t0 = now_ns();
+    int r = query_page_counts(rank);
+    record(API_QUERY_COUNTS, now_ns() - t0);
+    return r;
+}
+
+static int b_ranks(void *p) {
+    total_ops++;
+    if (!timed) return query_ranks(p);
+    uint64_t t0 = now_ns();
+    int r = query_ranks(p);
+    record(API_QUERY_RANKS, now_ns() - t0);
+    return r;
+}
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// Phases 2/4/7: fill the pool with rank-1 pages, query them, drain in order
+static void wl_sequential(void) {
+    int n = 0;
+    for (;;) {
+        void *r = b_alloc(1);
+        if (IS_ERR(r)) break;
+        held[n++] = r;
+    }
+    for (int i = 0; i < n; i++) b_ranks(held[i]);
+    for (int i = 0; i < n; i++) b_return(held[i]);
+    for (int rank = 1; rank <= MAXRANK; rank++) b_counts(rank);
+}
+
+// Random alloc/free over ranks 1..8 with a bounded working set
+static void wl_random(void) {
+    int slots = pages >= 16 ? pages / 16 : 1;    // Tiny pools still get a slot
+    memset(held, 0, slots * sizeof(void *));
+    for (int i = 0; i < pages * 4; i++) {
+        uint32_t x = rng();
+        int slot = x % slots;
+        if (held[slot] != NULL) {
+            b_return(held[slot]);
+            held[slot] = NULL;
+        } else {
+            void *r = b_alloc(1 + (x >> 24) % 8);
+            if (!IS_ERR(r)) held[slot] = r;
+        }
+    }
+    for (int slot = 0; slot < slots; slot++) {
+        if (held[slot] != NULL) b_return(held[slot]);
+    }
+}
+
+// Phase 8B: free every other page, then the rest, polling counts each time
+static void wl_alternating(void) {
+    int n = 0;
+    for (;;) {
+        void *r = b_alloc(1);
+        if (IS_ERR(r)) break;
+        held[n++] = r;
+    }
+    for (int i = 0; i < n; i += 2) {
+        b_return(held[i]);
+        b_counts(1);
+    }
+    for (int i = 1; i < n; i += 2) {
+        b_return(held[i]);
+        b_counts(1);
+    }
+    b_counts(MAXRANK);
+}
+
+// Producer/consumer: blocks are freed in FIFO order a fixed distance
+// behind the allocations, as when a consumer releases buffers it received
+static void wl_producer_consumer(void) {
+    int depth = pages >= 4 ? pages / 4 : 1;
+    int head = 0, tail = 0, live = 0;
+    for (int i = 0; i < pages * 4; i++) {
+        if (live == depth) {
+            b_return(held[tail]);
+            tail = (tail + 1) % depth;
+            live--;
+        }
+        void *r = b_alloc(1 + rng() % 3);
+        if (IS_ERR(r)) continue;
+        held[head] = r;
+        head = (head + 1) % depth;
+        live++;
+    }
+    while (live-- > 0) {
+        b_return(held[tail]);
+        tail = (tail + 1) % depth;
+    }
+}
+
+static int cmp_u32(const void *x, const void *y) {
+    uint32_t a = *(const uint32_t *)x, b = *(const uint32_t *)y;
+    return a < b ? -1 : a > b;
+}
+
+static uint32_t percentile(latency_t *l, double q) {
+    long idx = (long)(q * (l->count - 1));
+    return l->samples[idx];
+}
+
+static void run(const char *name, void (*workload)(void), int rounds) {
+    // Untimed pass for throughput
+    total_ops = 0;
+    timed = 0;
+    rng_state = 1;
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < rounds; i++) {
+        init_page(pool, pages);
+        workload();
+    }
+    uint64_t elapsed = now_ns() - t0;
+    long ops = total_ops;
+
+    // Timed pass for latency percentiles
+    for (int api = 0; api < API_COUNT; api++) lat[api].count = 0;
+    timed = 1;
+    rng_state = 1;
+    for (int i = 0; i < rounds; i++) {
+        init_page(pool, pages);
+        workload();
+    }
+
+    printf("%-18s %-18s %10ld %9.2f\n", name, "(all calls)", ops,
+           ops / (elapsed / 1e9) / 1e6);
+    for (int api = 0; api < API_COUNT; api++) {
+        latency_t *l = &lat[api];
+        if (l->count == 0) continue;
+        qsort(l->samples, l->count, sizeof(uint32_t), cmp_u32);
+        printf("%-18s %-18s %10ld %9s %7u %7u %7u\n", "", api_names[api],
+               l->count, "", percentile(l, 0.50), percentile(l, 0.99),
+               percentile(l, 0.999));
+    }
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 5;
+    if (argc > 2) pages = atoi(argv[2]);
+    if (rounds < 1 || pages < 1) {
+        fprintf(stderr, "usage: %s [rounds] [pages]\n", argv[0]);
+        return 1;
+    }
+
+    pool = malloc((size_t)pages * PAGE);
+    held = malloc((size_t)pages * sizeof(void *));
+    if (pool == NULL || held == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    // Fault the pool in up front so the first workload does not pay for it
+    memset(pool, 0, (size_t)pages * PAGE);
+
+    // Cost of one clock read, roughly what every timed call pays on top
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < 100000; i++) now_ns();
+    double timer_ns = (now_ns() - t0) / 100000.0;
+
+    printf("pool: %d pages, %d rounds, timer overhead ~%.0f ns (included in latencies)\n",
+           pages, rounds, timer_ns);
+    printf("%-18s %-18s %10s %9s %7s %7s %7s\n", "workload", "api", "calls",
+           "Mops/s", "p50ns", "p99ns", "p999ns");
+    run("sequential", wl_sequential, rounds);
+    run("random-mixed", wl_random, rounds);
+    run("alternating-8B", wl_alternating, rounds);
+    run("producer-consumer", wl_producer_consumer, rounds);
+
+    return 0;
+}
@@ -1,259 +1,2578 @@
+#ifdef BUDDY_THREAD_SAFE
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+#if defined(BUDDY_THREAD_SAFE) || defined(BUDDY_TRACE)
+#include <pthread.h>
+#endif
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef BUDDY_TRACE
+#include <time.h>
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "buddy.h"
-#define NULL ((void *)0)
 
-#define MAX_RANK 16
-#define PAGE_SIZE 4096
-#define MAX_PAGES (128 * 1024 / 4)
+// Rank range and page size are per arena; these are the defaults
+#define DEFAULT_MAX_RANK 16
+#define DEFAULT_PAGE_SHIFT 12
+#define MIN_PAGE_SHIFT 6
+#define MAX_PAGE_SHIFT 30
+#define CACHE_LINE 64
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+#define NO_PAGE (-1)
+
+#if defined(BUDDY_DEFERRED_FREE) && !defined(BUDDY_THREAD_SAFE)
+#error "BUDDY_DEFERRED_FREE requires BUDDY_THREAD_SAFE"
+#endif
 
-// Free list for each rank - doubly linked
+// The bitmap tree engine is the address-ordered bitmaps plus summary levels
+#if defined(BUDDY_BITMAP_TREE) && !defined(BUDDY_ADDRESS_ORDERED)
+#define BUDDY_ADDRESS_ORDERED
+#endif
+#define TREE_LEVELS 6   // Enough summary levels for 2^31 leaf bits
+
+// Free list for each rank - doubly linked through page indices.
+// By default the links live in the first bytes of each free block; building
+// with BUDDY_OOB_LINKS keeps them in a side array instead, so allocating and
+// freeing never read or write the managed pages.
 typedef struct free_block {
-    struct free_block *next;
-    struct free_block *prev;
+    int next;
+    int prev;
 } free_block_t;
 
-static free_block_t *free_lists[MAX_RANK + 1];
-static void *base_addr = NULL;
-static int total_pages = 0;
+// Free blocks keep their list links in their first bytes unless the links
+// are out of band or the engine has no links at all
+#if !defined(BUDDY_OOB_LINKS) && !defined(BUDDY_ADDRESS_ORDERED)
+#define LINKS_IN_POOL 1
+#else
+#define LINKS_IN_POOL 0
+#endif
+
+// Metadata to track allocated blocks, one byte per page. Only the first page
+// of a block carries its rank (low bits) and whether it is free (high bit);
+// every other page is 0.
+typedef uint8_t page_meta_t;
+
+#define META_RANK_MASK 0x1f
+#define META_RUN       0x20  // First piece of a trimmed alloc_bytes run
+#define META_CACHED    0x40  // Free but parked uncoalesced (per-CPU cache, lazy list); allocated to the core
+#define META_FREE      0x80
+
+// Later pieces of a trimmed run also carry META_CACHED, so every path that
+// frees or caches a block on its own refuses them; they go with the first.
+#define META_RUN_TAIL  (META_RUN | META_CACHED)
+
+// Slab heads carry META_RUN without a rank, which every path that frees,
+// resizes or queries a block refuses; the rank lives in the slab header.
+#define META_SLAB      META_RUN
+
+// Largest max_rank an arena can have, bounded by the metadata encoding
+#define RANK_LIMIT     BUDDY_RANK_LIMIT
+
+_Static_assert(RANK_LIMIT <= META_RANK_MASK, "rank does not fit in page metadata");
+_Static_assert(DEFAULT_MAX_RANK <= RANK_LIMIT, "bad DEFAULT_MAX_RANK");
+
+static inline int meta_rank(page_meta_t meta) {
+    return meta & META_RANK_MASK;
+}
+
+#ifdef BUDDY_THREAD_SAFE
+// Building with BUDDY_THREAD_SAFE serializes the buddy core with a per-arena
+// mutex and puts per-CPU caches of small blocks in front of it, in the spirit
+// of Linux's per-cpu pagesets. Each cache holds up to PCP_HIGH blocks per rank
+// and moves PCP_BATCH blocks at a time to or from the core, so most small
+// allocations and frees only touch the CPU-local cache.
+#ifndef BUDDY_PCP_MAX_RANK
+#define BUDDY_PCP_MAX_RANK 4   // Largest rank served from the per-CPU caches
+#endif
+#define PCP_SLOTS 16
+#define PCP_HIGH 32
+#define PCP_BATCH 16
+
+_Static_assert(BUDDY_PCP_MAX_RANK >= 1 && BUDDY_PCP_MAX_RANK <= RANK_LIMIT, "bad BUDDY_PCP_MAX_RANK");
+
+typedef struct {
+    int locked;                                     // Try-lock; contended callers fall back to the core
+    int count[BUDDY_PCP_MAX_RANK + 1];
+    int blocks[BUDDY_PCP_MAX_RANK + 1][PCP_HIGH];   // Stack of cached page indices per rank
+} __attribute__((aligned(CACHE_LINE))) pcp_cache_t;
+#endif
+
+// Size classes of the slab front-end, multiples of the cache line
+#define SLAB_CLASSES 12
+
+// All state of one managed region. Arenas are cache-line aligned so that
+// independent arenas never share a line of their hot header fields. The
+// per-page arrays are sized for the pool and live in a separate metadata
+// buffer: right after the header for buddy_arena_init*, heap-allocated for
+// the default arena.
+struct buddy_arena {
+    uint32_t magic;                      // ARENA_MAGIC once set up, for buddy_arena_attach
+    uint32_t build;                      // BUILD_TAG of the code that set it up
+    void *base_addr;
+    int total_pages;
+    int align_off;                       // Page offset of base_addr within its largest block
+    int max_rank;
+    int page_shift;
+    unsigned int free_mask;              // Bit r is set while rank r has free blocks
+#ifdef BUDDY_ADDRESS_ORDERED
+    uint64_t *free_bits[RANK_LIMIT + 1]; // Bit (page_idx >> (r - 1)) set per free block
+#ifdef BUDDY_BITMAP_TREE
+    uint64_t *free_tree[RANK_LIMIT + 1][TREE_LEVELS]; // Bit i of level l: word i of level l - 1 non-zero
+    int free_depth[RANK_LIMIT + 1];      // Summary levels in use; the top one is a single word
+#else
+    int free_hint[RANK_LIMIT + 1];       // No bits set in the words below this one
+#endif
+#else
+    int free_lists[RANK_LIMIT + 1];      // Page index of each list head, NO_PAGE if empty
+#endif
+    int free_counts[RANK_LIMIT + 1];     // Number of free blocks of each rank
+#ifdef BUDDY_LAZY
+    int lazy_lists[RANK_LIMIT + 1];      // Parked blocks per rank, singly linked
+    int lazy_counts[RANK_LIMIT + 1];
+    int lazy_total;
+#endif
+    page_meta_t *page_metadata;
+#ifdef BUDDY_OOB_LINKS
+    free_block_t *free_links;
+#endif
+#ifdef BUDDY_CHECKED
+    uint16_t *page_gen;                  // Bumped each time a block at the page is freed
+#endif
+    uint64_t *cold_bits;                 // Bit per page released to the OS and untouched since
+    long cold_pages;                     // Bits set in cold_bits
+#if LINKS_IN_POOL
+    free_block_t *cold_links;            // List links of free heads whose page is cold
+#endif
+    void *owned_mem;                     // Released by buddy_arena_destroy, NULL if caller-owned
+    unsigned long splits;                // Blocks halved to serve an allocation
+    unsigned long merges;                // Buddy pairs coalesced on free
+    unsigned long enospc;                // Allocations that failed; updated atomically
+    int slab_partial[SLAB_CLASSES];      // Slabs of each size class with free objects
+    int slab_full[SLAB_CLASSES];         // and without
+#ifdef BUDDY_THREAD_SAFE
+    pthread_mutex_t lock;                // Protects everything above but enospc
+    int pcp_cached;                      // Blocks currently parked in pcp[]
+    long pcp_pages;                      // Pages in those blocks
+    pcp_cache_t pcp[PCP_SLOTS];
+#ifdef BUDDY_DEFERRED_FREE
+    int deferred[RANK_LIMIT + 1] __attribute__((aligned(CACHE_LINE))); // Lock-free stacks of frees
+    long deferred_pages;                 // Pages on those stacks
+#endif
+#endif
+} __attribute__((aligned(CACHE_LINE)));
+
+#define ARENA_HEADER_SIZE ALIGN_UP(sizeof(struct buddy_arena), CACHE_LINE)
+
+// Everything in the header and per-page arrays but the pointers to them is
+// page indices and counters, so metadata kept in shared memory can be
+// re-attached at any address by a build with the same layout
+#define ARENA_MAGIC 0x62756479   // "budy"
+#define BUILD_TAG ((uint32_t)sizeof(struct buddy_arena) << 8 | BUILD_OPTIONS)
+
+#ifdef BUDDY_OOB_LINKS
+#define BUILD_OOB_LINKS 0x01
+#else
+#define BUILD_OOB_LINKS 0
+#endif
+#ifdef BUDDY_THREAD_SAFE
+#define BUILD_THREAD_SAFE 0x02
+#else
+#define BUILD_THREAD_SAFE 0
+#endif
+#ifdef BUDDY_LAZY
+#define BUILD_LAZY 0x04
+#else
+#define BUILD_LAZY 0
+#endif
+#ifdef BUDDY_ADDRESS_ORDERED
+#define BUILD_ADDRESS_ORDERED 0x08
+#else
+#define BUILD_ADDRESS_ORDERED 0
+#endif
+#ifdef BUDDY_BITMAP_TREE
+#define BUILD_BITMAP_TREE 0x10
+#else
+#define BUILD_BITMAP_TREE 0
+#endif
+#ifdef BUDDY_CHECKED
+#define BUILD_CHECKED 0x20
+#else
+#define BUILD_CHECKED 0
+#endif
+#ifdef BUDDY_DEFERRED_FREE
+#define BUILD_DEFERRED_FREE 0x40
+#else
+#define BUILD_DEFERRED_FREE 0
+#endif
+#define BUILD_OPTIONS (BUILD_OOB_LINKS | BUILD_THREAD_SAFE | BUILD_LAZY | BUILD_ADDRESS_ORDERED | \
+                       BUILD_BITMAP_TREE | BUILD_CHECKED | BUILD_DEFERRED_FREE)
+
+// Arena behind init_page/alloc_pages/return_pages/query_*
+static struct buddy_arena default_arena;
+static void *default_meta = NULL;   // Per-page arrays of the default arena
+static size_t default_meta_size = 0;
+
+// Building with BUDDY_TRACE records tracepoints in a per-thread ring. A
+// thread's ring is allocated on its first event and entered in a registry,
+// so buddy_trace_read_ring can drain it from a dumper thread; a ring stays
+// readable after its thread exits, until a new thread takes it over. Once
+// full, the oldest events are overwritten. Recording stays a few plain
+// stores: the owner bumps claimed before it overwrites a slot and head
+// after, and a reader keeps only the copies that claimed shows were not
+// clobbered meanwhile. Without BUDDY_TRACE the TRACE macros and their
+// arguments compile to nothing.
+#ifdef BUDDY_TRACE
+#ifndef BUDDY_TRACE_RING
+#define BUDDY_TRACE_RING 4096   // Events kept per thread, a power of two
+#endif
+#ifndef BUDDY_TRACE_MAX_THREADS
+#define BUDDY_TRACE_MAX_THREADS 256     // Registry size; threads beyond it go untraced
+#endif
+_Static_assert((BUDDY_TRACE_RING & (BUDDY_TRACE_RING - 1)) == 0, "BUDDY_TRACE_RING must be a power of two");
 
-// Metadata to track allocated blocks
 typedef struct {
-    int rank;  // 0 means free/unallocated, >0 means allocated with this rank
-    int is_free; // 1 if this page is the start of a free block, 0 otherwise
-} page_meta_t;
+    buddy_trace_event_t events[BUDDY_TRACE_RING];
+    unsigned long claimed;      // Events the owner started to record
+    unsigned long head;         // Events recorded in full
+    unsigned long tail;         // Events already read
+    int owned;                  // 0 once the owning thread exited
+} trace_ring_t;
+
+static trace_ring_t *trace_rings[BUDDY_TRACE_MAX_THREADS];
+static int trace_ring_count;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static __thread trace_ring_t *trace_mine;
+static __thread int trace_refused;          // Set if the registry was full
+static __thread int trace_sourced;          // Rank the current alloc was served from
+
+// Helper function to give up a ring when its thread exits
+static void trace_orphan(void *ring) {
+    __atomic_store_n(&((trace_ring_t *)ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_make_key(void) {
+    pthread_key_create(&trace_key, trace_orphan);
+}
+
+// Give the calling thread a ring: one an exited thread left behind, or a
+// new one added to the registry. Returns NULL if the registry is full.
+static trace_ring_t *trace_register(void) {
+    pthread_once(&trace_once, trace_make_key);
+    trace_ring_t *r = NULL;
+    int count = __atomic_load_n(&trace_ring_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count && i < BUDDY_TRACE_MAX_THREADS && r == NULL; i++) {
+        trace_ring_t *cand = __atomic_load_n(&trace_rings[i], __ATOMIC_ACQUIRE);
+        int orphaned = 0;
+        if (cand != NULL && __atomic_compare_exchange_n(&cand->owned, &orphaned, 1, 0,
+                                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            r = cand;
+        }
+    }
+    if (r == NULL) {
+        r = calloc(1, sizeof(*r));
+        int slot = r == NULL ? -1 : __atomic_fetch_add(&trace_ring_count, 1, __ATOMIC_RELAXED);
+        if (slot < 0 || slot >= BUDDY_TRACE_MAX_THREADS) {
+            free(r);
+            trace_refused = 1;
+            return NULL;
+        }
+        r->owned = 1;
+        __atomic_store_n(&trace_rings[slot], r, __ATOMIC_RELEASE);
+    }
+    pthread_setspecific(trace_key, r);
+    trace_mine = r;
+    return r;
+}
+
+static void trace_event(int event, int rank, int arg0, int arg1) {
+    trace_ring_t *r = trace_mine;
+    if (r == NULL && (trace_refused || (r = trace_register()) == NULL)) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long n = r->head;
+    __atomic_store_n(&r->claimed, n + 1, __ATOMIC_RELAXED);
+    // Release stores, so a reader that sees any of them sees claimed too
+    buddy_trace_event_t *e = &r->events[n & (BUDDY_TRACE_RING - 1)];
+    __atomic_store_n(&e->ns, (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec, __ATOMIC_RELEASE);
+    __atomic_store_n(&e->event, event, __ATOMIC_RELEASE);
+    __atomic_store_n(&e->rank, rank, __ATOMIC_RELEASE);
+    __atomic_store_n(&e->arg0, arg0, __ATOMIC_RELEASE);
+    __atomic_store_n(&e->arg1, arg1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, n + 1, __ATOMIC_RELEASE);
+}
+
+// Move up to max of a ring's events into out, oldest first. Readers race
+// with the owner and with each other, so a batch counts only once the
+// tail moves past it, and copies of slots the owner was overwriting are
+// dropped; those events are lost like any other overwritten ones.
+static int trace_drain(trace_ring_t *r, buddy_trace_event_t *out, int max) {
+    for (;;) {
+        unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned long first = head - tail > BUDDY_TRACE_RING ? head - BUDDY_TRACE_RING : tail;
+        int n = 0;
+        for (unsigned long i = first; n < max && i != head; i++, n++) {
+            buddy_trace_event_t *e = &r->events[i & (BUDDY_TRACE_RING - 1)];
+            out[n].ns = __atomic_load_n(&e->ns, __ATOMIC_ACQUIRE);
+            out[n].event = __atomic_load_n(&e->event, __ATOMIC_ACQUIRE);
+            out[n].rank = __atomic_load_n(&e->rank, __ATOMIC_ACQUIRE);
+            out[n].arg0 = __atomic_load_n(&e->arg0, __ATOMIC_ACQUIRE);
+            out[n].arg1 = __atomic_load_n(&e->arg1, __ATOMIC_ACQUIRE);
+        }
+        // Slots of events before claimed - BUDDY_TRACE_RING may have been rewritten
+        unsigned long claimed = __atomic_load_n(&r->claimed, __ATOMIC_RELAXED);
+        int lost = 0;
+        if (claimed - first > BUDDY_TRACE_RING) {
+            unsigned long stale = claimed - BUDDY_TRACE_RING - first;
+            lost = stale < (unsigned long)n ? (int)stale : n;
+        }
+        if (!__atomic_compare_exchange_n(&r->tail, &tail, first + n, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if (lost > 0) {
+            memmove(out, out + lost, (size_t)(n - lost) * sizeof(*out));
+            n -= lost;
+            if (n == 0) continue;
+        }
+        return n;
+    }
+}
+
+#define TRACE(event, rank, arg0, arg1) trace_event(BUDDY_TRACE_##event, rank, arg0, arg1)
+#define TRACE_SOURCED(rank) (trace_sourced = (rank))
+#define TRACE_SOURCED_RANK trace_sourced
+#else
+#define TRACE(event, rank, arg0, arg1) ((void)0)
+#define TRACE_SOURCED(rank) ((void)0)
+#endif
+
+int buddy_trace_read(buddy_trace_event_t *out, int max) {
+#ifdef BUDDY_TRACE
+    if (max < 0 || (max > 0 && out == NULL)) {
+        return -EINVAL;
+    }
+    return trace_mine != NULL ? trace_drain(trace_mine, out, max) : 0;
+#else
+    (void)out;
+    (void)max;
+    return 0;
+#endif
+}
+
+int buddy_trace_rings(void) {
+#ifdef BUDDY_TRACE
+    int count = __atomic_load_n(&trace_ring_count, __ATOMIC_ACQUIRE);
+    return count < BUDDY_TRACE_MAX_THREADS ? count : BUDDY_TRACE_MAX_THREADS;
+#else
+    return 0;
+#endif
+}
 
-static page_meta_t page_metadata[MAX_PAGES];
+int buddy_trace_read_ring(int ring, buddy_trace_event_t *out, int max) {
+    if (ring < 0 || ring >= buddy_trace_rings() || max < 0 || (max > 0 && out == NULL)) {
+        return -EINVAL;
+    }
+#ifdef BUDDY_TRACE
+    // Registered but not yet published
+    trace_ring_t *r = __atomic_load_n(&trace_rings[ring], __ATOMIC_ACQUIRE);
+    return r != NULL ? trace_drain(r, out, max) : 0;
+#else
+    return 0;
+#endif
+}
 
 // Helper function to get page index from address
-static int get_page_index(void *p) {
-    if (p < base_addr) return -1;
-    long offset = (char *)p - (char *)base_addr;
-    if (offset % PAGE_SIZE != 0) return -1;
-    int page_idx = offset / PAGE_SIZE;
-    if (page_idx >= total_pages) return -1;
-    return page_idx;
+static int get_page_index(struct buddy_arena *a, void *p) {
+    if (p < a->base_addr) return -1;
+    long offset = (char *)p - (char *)a->base_addr;
+    if (offset & (((long)1 << a->page_shift) - 1)) return -1;
+    offset >>= a->page_shift;
+    if (offset >= a->total_pages) return -1;
+    return (int)offset;
 }
 
 // Helper function to get address from page index
-static void *get_page_addr(int page_idx) {
-    return (char *)base_addr + page_idx * PAGE_SIZE;
+static void *get_page_addr(struct buddy_arena *a, int page_idx) {
+    return (char *)a->base_addr + ((long)page_idx << a->page_shift);
 }
 
+// Blocks are aligned on their size in the arena's logical page numbering,
+// page_idx + align_off. align_off is 0 unless the arena was set up with
+// BUDDY_ARENA_ALIGN_NATURAL, in which case logical numbers follow the
+// address, so large blocks line up with huge pages.
+
 // Helper function to get buddy page index
-static int get_buddy_index(int page_idx, int rank) {
+static int get_buddy_index(struct buddy_arena *a, int page_idx, int rank) {
     int block_size = 1 << (rank - 1); // 2^(rank-1) pages
-    return page_idx ^ block_size;
+    return ((page_idx + a->align_off) ^ block_size) - a->align_off;
 }
 
 // Helper function to check if a page is aligned for a given rank
-static int is_aligned(int page_idx, int rank) {
+static int is_aligned(struct buddy_arena *a, int page_idx, int rank) {
     int block_size = 1 << (rank - 1);
-    return (page_idx % block_size) == 0;
+    return ((page_idx + a->align_off) & (block_size - 1)) == 0;
 }
 
-int init_page(void *p, int pgcount) {
-    base_addr = p;
-    total_pages = pgcount;
+// Metadata is read and written with relaxed byte accesses: in the
+// thread-safe build the owner of a block moves its head in and out of a
+// per-CPU cache without holding the arena lock, and the frees and queries
+// look at a head before taking it, while the core rewrites heads under it.
+static page_meta_t load_meta(struct buddy_arena *a, int page_idx) {
+#ifdef BUDDY_THREAD_SAFE
+    return __atomic_load_n(&a->page_metadata[page_idx], __ATOMIC_RELAXED);
+#else
+    return a->page_metadata[page_idx];
+#endif
+}
 
-    // Initialize free lists
-    for (int i = 0; i <= MAX_RANK; i++) {
-        free_lists[i] = NULL;
-    }
+static void store_meta(struct buddy_arena *a, int page_idx, page_meta_t meta) {
+#ifdef BUDDY_THREAD_SAFE
+    __atomic_store_n(&a->page_metadata[page_idx], meta, __ATOMIC_RELAXED);
+#else
+    a->page_metadata[page_idx] = meta;
+#endif
+}
 
-    // Initialize metadata
-    for (int i = 0; i < total_pages; i++) {
-        page_metadata[i].rank = 0;
-        page_metadata[i].is_free = 0;
+// Helper function to claim an allocated head for a free under the arena
+// lock. In the thread-safe build a racing free on the per-CPU path may
+// flip the head to cached meanwhile; only one of the two gets the block.
+static int claim_meta(struct buddy_arena *a, int page_idx, page_meta_t meta) {
+#ifdef BUDDY_THREAD_SAFE
+    return __atomic_compare_exchange_n(&a->page_metadata[page_idx], &meta, meta | META_CACHED,
+                                       0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+#else
+    (void)a;
+    (void)page_idx;
+    (void)meta;
+    return 1;
+#endif
+}
+
+// Helper function to find the head page of the block containing a page.
+// Only block heads have non-zero metadata, and every page between the head
+// and page_idx is interior, so clearing the lowest set bit of the index one
+// step at a time reaches the head after at most one probe per rank. In
+// naturally aligned arenas the step can land before page 0, which an
+// unlocked walk racing with a merge may reach; page 0 heads the first block.
+static int find_block_head(struct buddy_arena *a, int page_idx) {
+    while (page_idx > 0 && load_meta(a, page_idx) == 0) {
+        int logical = page_idx + a->align_off;
+        int next = logical & (logical - 1);
+        page_idx = next > a->align_off ? next - a->align_off : 0;
     }
+    return page_idx;
+}
 
-    // Add all memory to the highest possible rank
-    int current_page = 0;
-    while (current_page < total_pages) {
-        // Find the largest rank that fits
-        int rank = MAX_RANK;
-        int block_size = 1 << (rank - 1);
+#if !defined(BUDDY_ADDRESS_ORDERED) || defined(BUDDY_LAZY) || defined(BUDDY_DEFERRED_FREE)
+// Helper function to get the free list links of a block
+static free_block_t *get_links(struct buddy_arena *a, int page_idx) {
+#ifdef BUDDY_OOB_LINKS
+    return &a->free_links[page_idx];
+#else
+    return (free_block_t *)get_page_addr(a, page_idx);
+#endif
+}
+#endif
 
-        while (rank > 0 && (current_page + block_size > total_pages || !is_aligned(current_page, rank))) {
-            rank--;
-            block_size = 1 << (rank - 1);
+// Pages of free blocks whose backing buddy_arena_release gave back to the
+// OS are cold: they read as zero and cost no memory until written. The
+// allocator never writes into a cold page, as a free head there keeps its
+// list links in cold_links instead, so a cold block stays cold through
+// splits, merges and allocation until its owner first uses it. Handing a
+// block out clears its bits, since the owner is about to touch it. Every
+// helper returns straight away while nothing is cold.
+
+// Helper function to apply op to the cold bits of n pages from first:
+// 0 tests that all are set, 1 sets and 2 clears them
+static int cold_range(struct buddy_arena *a, int first, int n, int op) {
+    for (int i = first; i < first + n;) {
+        int bit = i & 63;
+        int take = first + n - i < 64 - bit ? first + n - i : 64 - bit;
+        uint64_t mask = (take == 64 ? ~0ULL : (1ULL << take) - 1) << bit;
+        uint64_t *word = &a->cold_bits[i >> 6];
+        if (op == 0) {
+            if ((*word & mask) != mask) return 0;
+        } else if (op == 1) {
+            a->cold_pages += __builtin_popcountll(~*word & mask);
+            *word |= mask;
+        } else {
+            a->cold_pages -= __builtin_popcountll(*word & mask);
+            *word &= ~mask;
         }
+        i += take;
+    }
+    return 1;
+}
 
-        if (rank == 0) break;
+// Helper function to forget that pages are cold once they get written
+static void warm_pages(struct buddy_arena *a, int first, int n) {
+    if (a->cold_pages != 0) {
+        cold_range(a, first, n, 2);
+    }
+}
 
-        // Add this block to free list
-        free_block_t *block = (free_block_t *)get_page_addr(current_page);
-        block->next = free_lists[rank];
-        block->prev = NULL;
-        if (free_lists[rank] != NULL) {
-            free_lists[rank]->prev = block;
-        }
-        free_lists[rank] = block;
+#ifdef BUDDY_ADDRESS_ORDERED
+// Building with BUDDY_ADDRESS_ORDERED replaces the LIFO free lists with one
+// bitmap per rank and always hands out the lowest free block of a rank, so
+// allocations cluster at low addresses and the top of the pool stays in
+// large coalesced blocks. Blocks of rank r are 2^(r-1) pages apart, so
+// page_idx >> (r - 1) numbers them in address order.
 
-        // Mark as free in metadata
-        page_metadata[current_page].is_free = 1;
-        page_metadata[current_page].rank = rank;
+//
+// BUDDY_BITMAP_TREE additionally keeps summary levels above each bitmap, a
+// 64-ary tree of words where a set bit means the word below is non-zero.
+// Finding the lowest free block is then one ctz per level instead of a
+// scan, and setting or clearing a bit touches a parent word only when its
+// word turns non-zero or zero.
 
-        current_page += block_size;
-    }
+// Helper function to get the number of bitmap words for a rank
+static size_t bitmap_words(int pgcount, int rank) {
+    int blocks = pgcount > 0 ? ((pgcount - 1) >> (rank - 1)) + 1 : 1;
+    return ((size_t)blocks + 63) / 64;
+}
 
-    return OK;
+#ifdef BUDDY_BITMAP_TREE
+// Helper function to get the word count of every level of a rank's tree,
+// leaves first. Returns the number of summary levels.
+static int tree_shape(int pgcount, int rank, size_t words[TREE_LEVELS + 1]) {
+    int depth = 0;
+    words[0] = bitmap_words(pgcount, rank);
+    while (words[depth] > 1) {
+        words[depth + 1] = (words[depth] + 63) / 64;
+        depth++;
+    }
+    return depth;
 }
+#endif
 
-void *alloc_pages(int rank) {
-    if (rank < 1 || rank > MAX_RANK) {
-        return ERR_PTR(-EINVAL);
+// Helper function to get the bitmap space of a rank
+static size_t bitmap_size(int pgcount, int rank) {
+#ifdef BUDDY_BITMAP_TREE
+    size_t words[TREE_LEVELS + 1], total = 0;
+    int depth = tree_shape(pgcount, rank, words);
+    for (int level = 0; level <= depth; level++) {
+        total += words[level];
     }
+    return total * sizeof(uint64_t);
+#else
+    return bitmap_words(pgcount, rank) * sizeof(uint64_t);
+#endif
+}
 
-    // Find a free block of the requested rank or larger
-    int current_rank = rank;
-    while (current_rank <= MAX_RANK && free_lists[current_rank] == NULL) {
-        current_rank++;
+// Helper to point a rank's bitmap (and tree) into the metadata buffer
+static void bitmap_layout(struct buddy_arena *a, uint64_t *words_base, int pgcount, int rank) {
+    a->free_bits[rank] = words_base;
+#ifdef BUDDY_BITMAP_TREE
+    size_t words[TREE_LEVELS + 1];
+    a->free_depth[rank] = tree_shape(pgcount, rank, words);
+    for (int level = 1; level <= a->free_depth[rank]; level++) {
+        words_base += words[level - 1];
+        a->free_tree[rank][level - 1] = words_base;
     }
+#else
+    (void)pgcount;      // Flat bitmaps need no shape
+#endif
+}
 
-    if (current_rank > MAX_RANK) {
-        return ERR_PTR(-ENOSPC);
+// Helper function to test whether a block of a rank is free
+static int block_is_free(struct buddy_arena *a, int page_idx, int rank) {
+    int bit = page_idx >> (rank - 1);
+    return (a->free_bits[rank][bit / 64] >> (bit % 64)) & 1;
+}
+
+static void add_to_free_list(struct buddy_arena *a, int page_idx, int rank) {
+    int bit = page_idx >> (rank - 1);
+#ifdef BUDDY_BITMAP_TREE
+    uint64_t *word = &a->free_bits[rank][bit / 64];
+    for (int level = 0; ; level++) {
+        int was_empty = *word == 0;
+        *word |= (uint64_t)1 << (bit % 64);
+        if (!was_empty || level == a->free_depth[rank]) break;
+        bit /= 64;
+        word = &a->free_tree[rank][level][bit / 64];
+    }
+#else
+    a->free_bits[rank][bit / 64] |= (uint64_t)1 << (bit % 64);
+    if (bit / 64 < a->free_hint[rank]) {
+        a->free_hint[rank] = bit / 64;
     }
+#endif
+    a->free_counts[rank]++;
+    a->free_mask |= 1u << rank;
+}
 
-    // Remove block from free list
-    free_block_t *block = free_lists[current_rank];
-    free_lists[current_rank] = block->next;
-    if (block->next != NULL) {
-        block->next->prev = NULL;
+static void remove_from_free_list(struct buddy_arena *a, int page_idx, int rank) {
+    int bit = page_idx >> (rank - 1);
+#ifdef BUDDY_BITMAP_TREE
+    uint64_t *word = &a->free_bits[rank][bit / 64];
+    for (int level = 0; ; level++) {
+        *word &= ~((uint64_t)1 << (bit % 64));
+        if (*word != 0 || level == a->free_depth[rank]) break;
+        bit /= 64;
+        word = &a->free_tree[rank][level][bit / 64];
     }
+#else
+    a->free_bits[rank][bit / 64] &= ~((uint64_t)1 << (bit % 64));
+#endif
+    if (--a->free_counts[rank] == 0) {
+        a->free_mask &= ~(1u << rank);
+    }
+}
 
-    int page_idx = get_page_index(block);
-    page_metadata[page_idx].is_free = 0;
+// Helper function to get the lowest free block of a non-empty rank
+static int first_free_block(struct buddy_arena *a, int rank) {
+#ifdef BUDDY_BITMAP_TREE
+    // Descend from the single top word, one ctz per level
+    int bit = 0;
+    for (int level = a->free_depth[rank]; level > 0; level--) {
+        bit = bit * 64 + __builtin_ctzll(a->free_tree[rank][level - 1][bit]);
+    }
+    bit = bit * 64 + __builtin_ctzll(a->free_bits[rank][bit]);
+#else
+    int word = a->free_hint[rank];
+    while (a->free_bits[rank][word] == 0) {
+        word++;
+    }
+    a->free_hint[rank] = word;
+    int bit = word * 64 + __builtin_ctzll(a->free_bits[rank][word]);
+#endif
+    // Blocks of this rank start at this residue of the block size
+    int block_size = 1 << (rank - 1);
+    return (bit << (rank - 1)) + (-a->align_off & (block_size - 1));
+}
+#else
+// Helper function to get the links of a block on a free list, which are
+// out of band while its head page is cold
+static free_block_t *list_links(struct buddy_arena *a, int page_idx) {
+#if LINKS_IN_POOL
+    if (a->cold_pages != 0 && cold_range(a, page_idx, 1, 0)) {
+        return &a->cold_links[page_idx];
+    }
+#endif
+    return get_links(a, page_idx);
+}
 
-    // Split the block if necessary
-    while (current_rank > rank) {
-        current_rank--;
-        int block_size = 1 << (current_rank - 1);
+// Helper to push a block onto the head of its free list
+static void add_to_free_list(struct buddy_arena *a, int page_idx, int rank) {
+    free_block_t *block = list_links(a, page_idx);
+    block->next = a->free_lists[rank];
+    block->prev = NO_PAGE;
+    if (a->free_lists[rank] != NO_PAGE) {
+        list_links(a, a->free_lists[rank])->prev = page_idx;
+    }
+    TRACE(LIST_HEAD, rank, page_idx, a->free_lists[rank]);
+    a->free_lists[rank] = page_idx;
+    a->free_counts[rank]++;
+    a->free_mask |= 1u << rank;
+}
 
-        int buddy_idx = page_idx + block_size;
+// Helper to remove a specific block from free list - O(1) with doubly-linked list
+static void remove_from_free_list(struct buddy_arena *a, int page_idx, int rank) {
+    free_block_t *block = list_links(a, page_idx);
 
-        // Add buddy to free list
-        free_block_t *buddy = (free_block_t *)get_page_addr(buddy_idx);
-        buddy->next = free_lists[current_rank];
-        buddy->prev = NULL;
-        if (free_lists[current_rank] != NULL) {
-            free_lists[current_rank]->prev = buddy;
+    if (block->prev != NO_PAGE) {
+        list_links(a, block->prev)->next = block->next;
+    } else {
+        // This is the head of the list
+        TRACE(LIST_HEAD, rank, block->next, page_idx);
+        a->free_lists[rank] = block->next;
+        if (block->next == NO_PAGE) {
+            a->free_mask &= ~(1u << rank);
         }
-        free_lists[current_rank] = buddy;
+    }
 
-        // Mark buddy as free
-        page_metadata[buddy_idx].is_free = 1;
-        page_metadata[buddy_idx].rank = current_rank;
+    if (block->next != NO_PAGE) {
+        list_links(a, block->next)->prev = block->prev;
     }
+    a->free_counts[rank]--;
+}
 
-    // Mark pages as allocated
-    page_metadata[page_idx].rank = rank;
+// Helper function to get the head block of a non-empty free list
+static int first_free_block(struct buddy_arena *a, int rank) {
+    return a->free_lists[rank];
+}
 
-    return (void *)block;
+// Helper function to test whether a block of a rank is free
+static int block_is_free(struct buddy_arena *a, int page_idx, int rank) {
+    return load_meta(a, page_idx) == (META_FREE | rank);
 }
+#endif
 
-// Helper to remove a specific block from free list - O(1) with doubly-linked list
-static void remove_from_free_list(int page_idx, int rank) {
-    free_block_t *block = (free_block_t *)get_page_addr(page_idx);
+// Helper function to get the size of the per-page arrays for a pool
+static size_t arrays_size(int pgcount) {
+    size_t size = ALIGN_UP((size_t)pgcount * sizeof(page_meta_t), CACHE_LINE);
+#ifdef BUDDY_OOB_LINKS
+    size += ALIGN_UP((size_t)pgcount * sizeof(free_block_t), CACHE_LINE);
+#endif
+#ifdef BUDDY_CHECKED
+    size += ALIGN_UP((size_t)pgcount * sizeof(uint16_t), CACHE_LINE);
+#endif
+    size += ALIGN_UP(((size_t)pgcount + 63) / 64 * sizeof(uint64_t), CACHE_LINE);
+#if LINKS_IN_POOL
+    size += ALIGN_UP((size_t)pgcount * sizeof(free_block_t), CACHE_LINE);
+#endif
+#ifdef BUDDY_ADDRESS_ORDERED
+    size_t bitmaps = 0;
+    for (int rank = 1; rank <= RANK_LIMIT; rank++) {
+        bitmaps += bitmap_size(pgcount, rank);
+    }
+    size += ALIGN_UP(bitmaps, CACHE_LINE);
+#endif
+    return size;
+}
 
-    if (block->prev != NULL) {
-        block->prev->next = block->next;
-    } else {
-        // This is the head of the list
-        free_lists[rank] = block->next;
+// Helper to point the per-page arrays of an arena into a metadata buffer
+static void arena_layout(struct buddy_arena *a, char *arrays, int pgcount) {
+    a->page_metadata = (page_meta_t *)arrays;
+    arrays += ALIGN_UP((size_t)pgcount * sizeof(page_meta_t), CACHE_LINE);
+#ifdef BUDDY_OOB_LINKS
+    a->free_links = (free_block_t *)arrays;
+    arrays += ALIGN_UP((size_t)pgcount * sizeof(free_block_t), CACHE_LINE);
+#endif
+#ifdef BUDDY_CHECKED
+    a->page_gen = (uint16_t *)arrays;
+    arrays += ALIGN_UP((size_t)pgcount * sizeof(uint16_t), CACHE_LINE);
+#endif
+    a->cold_bits = (uint64_t *)arrays;
+    arrays += ALIGN_UP(((size_t)pgcount + 63) / 64 * sizeof(uint64_t), CACHE_LINE);
+#if LINKS_IN_POOL
+    a->cold_links = (free_block_t *)arrays;
+    arrays += ALIGN_UP((size_t)pgcount * sizeof(free_block_t), CACHE_LINE);
+#endif
+#ifdef BUDDY_ADDRESS_ORDERED
+    for (int rank = 1; rank <= RANK_LIMIT; rank++) {
+        bitmap_layout(a, (uint64_t *)arrays, pgcount, rank);
+        arrays += bitmap_size(pgcount, rank);
+    }
+#endif
+}
+
+static int arena_setup(struct buddy_arena *a, void *p, int pgcount, int align_off,
+                       int max_rank, int page_shift) {
+    a->magic = ARENA_MAGIC;
+    a->build = BUILD_TAG;
+    a->base_addr = p;
+    a->total_pages = pgcount;
+    a->align_off = align_off;
+    a->max_rank = max_rank;
+    a->page_shift = page_shift;
+
+    // Initialize free lists
+    for (int i = 0; i <= RANK_LIMIT; i++) {
+#ifdef BUDDY_ADDRESS_ORDERED
+        if (i > 0) {
+            memset(a->free_bits[i], 0, bitmap_size(pgcount, i));
+        }
+#ifndef BUDDY_BITMAP_TREE
+        a->free_hint[i] = 0;
+#endif
+#else
+        a->free_lists[i] = NO_PAGE;
+#endif
+        a->free_counts[i] = 0;
+#ifdef BUDDY_LAZY
+        a->lazy_lists[i] = NO_PAGE;
+        a->lazy_counts[i] = 0;
+#endif
+    }
+    a->free_mask = 0;
+#ifdef BUDDY_LAZY
+    a->lazy_total = 0;
+#endif
+    a->splits = 0;
+    a->merges = 0;
+    a->enospc = 0;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        a->slab_partial[i] = NO_PAGE;
+        a->slab_full[i] = NO_PAGE;
     }
 
-    if (block->next != NULL) {
-        block->next->prev = block->prev;
+    // Initialize metadata
+    memset(a->page_metadata, 0, (size_t)a->total_pages * sizeof(page_meta_t));
+#ifdef BUDDY_CHECKED
+    memset(a->page_gen, 0, (size_t)a->total_pages * sizeof(uint16_t));
+#endif
+    memset(a->cold_bits, 0, ((size_t)a->total_pages + 63) / 64 * sizeof(uint64_t));
+    a->cold_pages = 0;
+
+#ifdef BUDDY_THREAD_SAFE
+    pthread_mutex_init(&a->lock, NULL);
+    a->pcp_cached = 0;
+    a->pcp_pages = 0;
+#ifdef BUDDY_DEFERRED_FREE
+    for (int i = 0; i <= RANK_LIMIT; i++) {
+        a->deferred[i] = NO_PAGE;
+    }
+    a->deferred_pages = 0;
+#endif
+    memset(a->pcp, 0, sizeof(a->pcp));
+#endif
+
+    // Cover the pool with the largest blocks possible. Each block is capped
+    // by the alignment of its first page (trailing zeros of the logical
+    // page number) and by what is left (highest set bit of the remainder).
+    int current_page = 0;
+    while (current_page < a->total_pages) {
+        int logical = current_page + a->align_off;
+        int rank = 32 - __builtin_clz(a->total_pages - current_page);
+        if (logical != 0 && __builtin_ctz(logical) + 1 < rank) {
+            rank = __builtin_ctz(logical) + 1;
+        }
+        if (rank > a->max_rank) {
+            rank = a->max_rank;
+        }
+
+        // Add this block to free list
+        add_to_free_list(a, current_page, rank);
+
+        // Mark as free in metadata
+        a->page_metadata[current_page] = META_FREE | rank;
+
+        current_page += 1 << (rank - 1);
     }
+
+    return OK;
 }
 
-int return_pages(void *p) {
-    if (p == NULL) {
-        return -EINVAL;
+size_t buddy_arena_meta_size(int pgcount) {
+    if (pgcount < 0) {
+        return 0;
     }
+    // Slack for aligning the header inside an arbitrary caller buffer
+    return CACHE_LINE - 1 + ARENA_HEADER_SIZE + arrays_size(pgcount);
+}
 
-    int page_idx = get_page_index(p);
-    if (page_idx < 0) {
-        return -EINVAL;
+// Set up an arena, or with attach find the one an earlier process set up
+// with the same arguments and point it at the current mappings
+static buddy_arena_t *arena_open(void *p, int pgcount, const buddy_arena_config_t *cfg, int attach) {
+    static const buddy_arena_config_t defaults;
+    if (cfg == NULL) {
+        cfg = &defaults;
+    }
+    if (p == NULL || pgcount < 0 ||
+        (cfg->flags & ~(BUDDY_ARENA_ALIGN_NATURAL | BUDDY_ARENA_META_IN_POOL))) {
+        return ERR_PTR(-EINVAL);
     }
 
-    int rank = page_metadata[page_idx].rank;
-    if (rank == 0 || page_metadata[page_idx].is_free) {
-        return -EINVAL;
+    int max_rank = cfg->max_rank ? cfg->max_rank : DEFAULT_MAX_RANK;
+    int page_shift = cfg->page_shift ? cfg->page_shift : DEFAULT_PAGE_SHIFT;
+    if (max_rank < 1 || max_rank > RANK_LIMIT ||
+        page_shift < MIN_PAGE_SHIFT || page_shift > MAX_PAGE_SHIFT) {
+        return ERR_PTR(-EINVAL);
+    }
+    size_t page_size = (size_t)1 << page_shift;
+
+    void *meta = cfg->meta;
+    size_t meta_size = cfg->meta_size;
+    void *owned = NULL;
+
+    if (cfg->flags & BUDDY_ARENA_META_IN_POOL) {
+        // Carve the metadata out of the head of the pool
+        meta_size = buddy_arena_meta_size(pgcount);
+        int meta_pages = (meta_size + page_size - 1) >> page_shift;
+        if (meta_pages >= pgcount) {
+            return ERR_PTR(-EINVAL);
+        }
+        meta = p;
+        meta_size = (size_t)meta_pages << page_shift;
+        p = (char *)p + meta_size;
+        pgcount -= meta_pages;
+    } else if (meta == NULL) {
+        // Heap metadata dies with its process
+        if (attach) {
+            return ERR_PTR(-EINVAL);
+        }
+        meta_size = ALIGN_UP(buddy_arena_meta_size(pgcount), CACHE_LINE);
+        meta = owned = aligned_alloc(CACHE_LINE, meta_size);
+        if (meta == NULL) {
+            return ERR_PTR(-ENOMEM);
+        }
+    }
+
+    if (meta_size < buddy_arena_meta_size(pgcount)) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    int align_off = 0;
+    if (cfg->flags & BUDDY_ARENA_ALIGN_NATURAL) {
+        if ((uintptr_t)p % page_size != 0) {
+            free(owned);
+            return ERR_PTR(-EINVAL);
+        }
+        align_off = ((uintptr_t)p >> page_shift) & ((1u << (max_rank - 1)) - 1);
+    }
+
+    struct buddy_arena *a = (struct buddy_arena *)ALIGN_UP((size_t)meta, CACHE_LINE);
+    if (attach && (a->magic != ARENA_MAGIC || a->build != BUILD_TAG ||
+                   a->total_pages != pgcount || a->align_off != align_off ||
+                   a->max_rank != max_rank || a->page_shift != page_shift)) {
+        return ERR_PTR(-EINVAL);
+    }
+    arena_layout(a, (char *)a + ARENA_HEADER_SIZE, pgcount);
+    a->owned_mem = owned;
+    if (attach) {
+        a->base_addr = p;
+    } else {
+        arena_setup(a, p, pgcount, align_off, max_rank, page_shift);
+    }
+    return a;
+}
+
+buddy_arena_t *buddy_arena_init_config(void *p, int pgcount, const buddy_arena_config_t *cfg) {
+    return arena_open(p, pgcount, cfg, 0);
+}
+
+buddy_arena_t *buddy_arena_init_meta(void *p, int pgcount, void *meta, size_t meta_size) {
+    buddy_arena_config_t cfg = {
+        .flags = meta == NULL ? BUDDY_ARENA_META_IN_POOL : 0,
+        .meta = meta,
+        .meta_size = meta_size,
+    };
+    return buddy_arena_init_config(p, pgcount, &cfg);
+}
+
+buddy_arena_t *buddy_arena_init(void *p, int pgcount) {
+    return buddy_arena_init_config(p, pgcount, NULL);
+}
+
+void buddy_arena_destroy(buddy_arena_t *a) {
+    if (a != NULL && a != &default_arena && !IS_ERR(a)) {
+        free(a->owned_mem);
     }
+}
+
+buddy_arena_t *buddy_default_arena(void) {
+    return &default_arena;
+}
+
+// Give a block back to the free lists, merging it with free buddies
+static void free_block(struct buddy_arena *a, int page_idx, int rank) {
+#ifdef BUDDY_TRACE
+    int freed_rank = rank;
+#endif
 
     // Try to merge with buddy
-    while (rank < MAX_RANK) {
-        int buddy_idx = get_buddy_index(page_idx, rank);
+    while (rank < a->max_rank) {
+        int buddy_idx = get_buddy_index(a, page_idx, rank);
 
         // Check if buddy exists and is free with the same rank
-        if (buddy_idx < 0 || buddy_idx >= total_pages) break;
-        if (!page_metadata[buddy_idx].is_free || page_metadata[buddy_idx].rank != rank) break;
+        if (buddy_idx < 0 || buddy_idx >= a->total_pages) break;
+        if (!block_is_free(a, buddy_idx, rank)) break;
 
-        // Remove buddy from free list
-        remove_from_free_list(buddy_idx, rank);
-        page_metadata[buddy_idx].is_free = 0;
+        // Remove buddy from free list; neither half stays a block head
+        remove_from_free_list(a, buddy_idx, rank);
+        store_meta(a, buddy_idx, 0);
+        store_meta(a, page_idx, 0);
 
         // Merge with buddy
         if (page_idx > buddy_idx) {
             page_idx = buddy_idx;
         }
         rank++;
+        a->merges++;
     }
+#ifdef BUDDY_TRACE
+    if (rank > freed_rank) {
+        TRACE(MERGE, rank, rank - freed_rank, page_idx);
+    }
+#endif
 
     // Add merged block to free list
-    free_block_t *block = (free_block_t *)get_page_addr(page_idx);
-    block->next = free_lists[rank];
-    block->prev = NULL;
-    if (free_lists[rank] != NULL) {
-        free_lists[rank]->prev = block;
-    }
-    free_lists[rank] = block;
+    add_to_free_list(a, page_idx, rank);
 
     // Mark as free
-    page_metadata[page_idx].is_free = 1;
-    page_metadata[page_idx].rank = rank;
+    store_meta(a, page_idx, META_FREE | rank);
+}
 
-    return OK;
+// Free every piece of a trimmed alloc_bytes run, starting at its first
+static void free_run(struct buddy_arena *a, int page_idx, int rank) {
+    for (;;) {
+        int next_idx = page_idx + (1 << (rank - 1));
+        free_block(a, page_idx, rank);
+
+        if (next_idx >= a->total_pages) break;
+        page_meta_t next = load_meta(a, next_idx);
+        if ((next & ~META_RANK_MASK) != META_RUN_TAIL) break;
+        page_idx = next_idx;
+        rank = meta_rank(next);
+    }
 }
 
-int query_ranks(void *p) {
-    int page_idx = get_page_index(p);
-    if (page_idx < 0) {
-        return -EINVAL;
+#ifdef BUDDY_LAZY
+// Building with BUDDY_LAZY defers coalescing: return_pages parks blocks
+// uncoalesced on a per-rank lazy list, where a same-rank alloc picks them
+// up again without any split or merge. They are merged into the free lists
+// once no larger block is left to split, when a rank collects
+// BUDDY_LAZY_HIGH parked blocks, or before a query so callers always see
+// the fully coalesced pool.
+#ifndef BUDDY_LAZY_HIGH
+#define BUDDY_LAZY_HIGH 64
+#endif
+
+static void lazy_push(struct buddy_arena *a, int page_idx, int rank) {
+    get_links(a, page_idx)->next = a->lazy_lists[rank];
+    a->lazy_lists[rank] = page_idx;
+    a->lazy_counts[rank]++;
+    a->lazy_total++;
+    store_meta(a, page_idx, META_CACHED | rank);
+}
+
+static int lazy_pop(struct buddy_arena *a, int rank) {
+    int page_idx = a->lazy_lists[rank];
+    a->lazy_lists[rank] = get_links(a, page_idx)->next;
+    a->lazy_counts[rank]--;
+    a->lazy_total--;
+    return page_idx;
+}
+
+// Merge every parked block of a rank into the free lists
+static void lazy_flush(struct buddy_arena *a, int rank) {
+    while (a->lazy_counts[rank] > 0) {
+        free_block(a, lazy_pop(a, rank), rank);
+    }
+}
+
+static void lazy_flush_all(struct buddy_arena *a) {
+    for (int rank = 1; a->lazy_total > 0 && rank <= a->max_rank; rank++) {
+        lazy_flush(a, rank);
     }
+}
 
-    // If allocated, return the rank
-    if (!page_metadata[page_idx].is_free && page_metadata[page_idx].rank > 0) {
-        return page_metadata[page_idx].rank;
+// Park a freed block, coalescing its rank once the watermark is crossed
+static void lazy_free(struct buddy_arena *a, int page_idx, int rank) {
+    lazy_push(a, page_idx, rank);
+    if (a->lazy_counts[rank] >= BUDDY_LAZY_HIGH) {
+        lazy_flush(a, rank);
     }
+}
+#endif
 
-    // If unallocated, find the maximum rank this page belongs to
-    for (int rank = MAX_RANK; rank >= 1; rank--) {
-        if (!is_aligned(page_idx, rank)) continue;
+// Take a block of the given rank off the free lists, splitting a larger one
+// if needed. Returns its page index or -ENOSPC.
+static int alloc_block(struct buddy_arena *a, int rank) {
+#ifdef BUDDY_LAZY
+    if (a->lazy_counts[rank] > 0) {
+        int page_idx = lazy_pop(a, rank);
+        store_meta(a, page_idx, rank);
+        TRACE_SOURCED(rank);
+        return page_idx;
+    }
+#endif
 
-        int block_size = 1 << (rank - 1);
-        if (page_idx + block_size > total_pages) continue;
+    // Find the smallest non-empty free list of the requested rank or larger
+    unsigned int candidates = a->free_mask >> rank;
+#ifdef BUDDY_LAZY
+    // Coalesce the parked blocks only once no larger block is left to split
+    if (candidates == 0 && a->lazy_total > 0) {
+        lazy_flush_all(a);
+        candidates = a->free_mask >> rank;
+    }
+#endif
+    if (candidates == 0) {
+        return -ENOSPC;
+    }
+    int current_rank = rank + __builtin_ctz(candidates);
+
+    // Remove block from free list
+    int page_idx = first_free_block(a, current_rank);
+    remove_from_free_list(a, page_idx, current_rank);
+
+    // Split the block if necessary
+    a->splits += current_rank - rank;
+    TRACE_SOURCED(current_rank);
+    if (current_rank > rank) {
+        TRACE(SPLIT, current_rank, current_rank - rank, page_idx);
+    }
+    while (current_rank > rank) {
+        current_rank--;
+        int block_size = 1 << (current_rank - 1);
+
+        int buddy_idx = page_idx + block_size;
+
+        // Add buddy to free list
+        add_to_free_list(a, buddy_idx, current_rank);
+
+        // Mark buddy as free
+        store_meta(a, buddy_idx, META_FREE | current_rank);
+    }
+
+    // Mark pages as allocated
+    store_meta(a, page_idx, rank);
+    warm_pages(a, page_idx, 1 << (rank - 1));
+
+    return page_idx;
+}
+
+// Put the pages [start, end) of a split block back on the free lists as the
+// largest aligned blocks that fit. base is the head of the enclosing block,
+// which must span a power of two pages ending at or after end. Returns the
+// number of blocks added.
+static int free_range(struct buddy_arena *a, int base, int start, int end) {
+    int blocks = 0;
+    while (start < end) {
+        int rank = __builtin_ctz(start - base) + 1;
+        add_to_free_list(a, start, rank);
+        store_meta(a, start, META_FREE | rank);
+        start += 1 << (rank - 1);
+        blocks++;
+    }
+    return blocks;
+}
+
+// Take up to n blocks of the given rank off the free lists. Each source
+// block is split once and handed out child by child, with only the unused
+// tail going back to the free lists. Returns the number of page indices
+// stored in out.
+static int alloc_blocks(struct buddy_arena *a, int rank, int n, int *out) {
+    int block_size = 1 << (rank - 1);
+    int done = 0;
+
+#ifdef BUDDY_LAZY
+    while (done < n && a->lazy_counts[rank] > 0) {
+        int page_idx = lazy_pop(a, rank);
+        store_meta(a, page_idx, rank);
+        out[done++] = page_idx;
+    }
+#endif
+
+    while (done < n) {
+        unsigned int candidates = a->free_mask >> rank;
+#ifdef BUDDY_LAZY
+        if (candidates == 0 && a->lazy_total > 0) {
+            lazy_flush_all(a);
+            candidates = a->free_mask >> rank;
+        }
+#endif
+        if (candidates == 0) break;
+        int current_rank = rank + __builtin_ctz(candidates);
+
+        int page_idx = first_free_block(a, current_rank);
+        remove_from_free_list(a, page_idx, current_rank);
+        if (current_rank > rank) {
+            TRACE(SPLIT, current_rank, current_rank - rank, page_idx);
+        }
 
-        // Check if this block is in the free list
-        if (page_metadata[page_idx].is_free && page_metadata[page_idx].rank == rank) {
-            return rank;
+        int children = 1 << (current_rank - rank);
+        int take = children < n - done ? children : n - done;
+        for (int i = 0; i < take; i++) {
+            int child_idx = page_idx + i * block_size;
+            store_meta(a, child_idx, rank);
+            out[done++] = child_idx;
         }
+        warm_pages(a, page_idx, take * block_size);
+        // Cutting one block into k pieces takes k - 1 halvings
+        int rest = free_range(a, page_idx, page_idx + take * block_size, page_idx + children * block_size);
+        a->splits += take + rest - 1;
     }
 
-    return 1; // Default to rank 1
+    return done;
 }
 
-int query_page_counts(int rank) {
-    if (rank < 1 || rank > MAX_RANK) {
-        return -EINVAL;
+#ifdef BUDDY_CHECKED
+// Building with BUDDY_CHECKED keeps a 16-bit generation per page that every
+// successful free of a block at that page bumps. buddy_arena_alloc_tagged hands out
+// the current generation with the block and buddy_arena_free_tagged
+// refuses a stale one, which catches frees through pointers that outlived
+// their block even after the pages were reallocated in a different shape.
+// Frees also check that a head sits on its rank's alignment.
+
+// Helper function to get the generation of a page
+static unsigned int page_tag(struct buddy_arena *a, int page_idx) {
+    return __atomic_load_n(&a->page_gen[page_idx], __ATOMIC_RELAXED);
+}
+
+static void bump_tag(struct buddy_arena *a, int page_idx) {
+    __atomic_add_fetch(&a->page_gen[page_idx], 1, __ATOMIC_RELAXED);
+}
+#endif
+
+#ifdef BUDDY_THREAD_SAFE
+#ifdef BUDDY_DEFERRED_FREE
+// Building with BUDDY_DEFERRED_FREE as well takes frees off the lock
+// entirely: return_pages claims the block by flipping its metadata to
+// cached with a compare-and-swap, then pushes it onto a per-rank Treiber
+// stack linked through the block itself. Whoever takes the arena lock next
+// detaches each stack with one exchange and coalesces the blocks, so the
+// buddy core keeps a single writer. Stacks are only ever detached whole,
+// never popped one entry at a time, so plain indices are safe from ABA.
+
+// Push a freed block onto its rank's stack. Returns 0 if p is not a plain
+// allocated head, leaving the caller to take the locked path.
+static int deferred_free(struct buddy_arena *a, int page_idx) {
+    page_meta_t meta = load_meta(a, page_idx);
+    int rank = meta_rank(meta);
+    if (rank == 0 || rank > a->max_rank || meta != rank) {
+        return 0;
+    }
+    // A racing double free of the same block loses here
+    if (!__atomic_compare_exchange_n(&a->page_metadata[page_idx], &meta, META_CACHED | rank,
+                                     0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+#ifdef BUDDY_CHECKED
+    bump_tag(a, page_idx);
+#endif
+
+    __atomic_add_fetch(&a->deferred_pages, 1L << (rank - 1), __ATOMIC_RELAXED);
+    free_block_t *links = get_links(a, page_idx);
+    int head = __atomic_load_n(&a->deferred[rank], __ATOMIC_RELAXED);
+    do {
+        links->next = head;
+    } while (!__atomic_compare_exchange_n(&a->deferred[rank], &head, page_idx,
+                                          1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+// Coalesce everything on the stacks. Called with the arena lock held.
+static void deferred_drain(struct buddy_arena *a) {
+    for (int rank = 1; rank <= a->max_rank; rank++) {
+        if (__atomic_load_n(&a->deferred[rank], __ATOMIC_RELAXED) == NO_PAGE) continue;
+
+        int page_idx = __atomic_exchange_n(&a->deferred[rank], NO_PAGE, __ATOMIC_ACQUIRE);
+        long pages = 0;
+        while (page_idx != NO_PAGE) {
+            int next = get_links(a, page_idx)->next;
+#ifdef BUDDY_LAZY
+            lazy_free(a, page_idx, rank);
+#else
+            free_block(a, page_idx, rank);
+#endif
+            pages += 1L << (rank - 1);
+            page_idx = next;
+        }
+        __atomic_sub_fetch(&a->deferred_pages, pages, __ATOMIC_RELAXED);
     }
+}
+#endif
 
-    int count = 0;
-    free_block_t *curr = free_lists[rank];
-    while (curr != NULL) {
-        count++;
-        curr = curr->next;
+static void arena_lock(struct buddy_arena *a) {
+    pthread_mutex_lock(&a->lock);
+#ifdef BUDDY_DEFERRED_FREE
+    // Every pass through the core first catches up on deferred frees
+    if (__atomic_load_n(&a->deferred_pages, __ATOMIC_RELAXED) != 0) {
+        deferred_drain(a);
     }
+#endif
+}
 
-    return count;
+static void arena_unlock(struct buddy_arena *a) {
+    pthread_mutex_unlock(&a->lock);
+}
+
+// Helper to try-lock the cache of the current CPU, NULL if it is busy
+static pcp_cache_t *pcp_trylock(struct buddy_arena *a) {
+    pcp_cache_t *pcp = &a->pcp[(unsigned int)sched_getcpu() % PCP_SLOTS];
+    if (__atomic_exchange_n(&pcp->locked, 1, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return pcp;
+}
+
+static void pcp_lock(pcp_cache_t *pcp) {
+    while (__atomic_exchange_n(&pcp->locked, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void pcp_unlock(pcp_cache_t *pcp) {
+    __atomic_store_n(&pcp->locked, 0, __ATOMIC_RELEASE);
+}
+
+// Refill an empty cache with a batch of blocks from the core. The stack is
+// filled top-down so blocks are handed out in the order the core produced them.
+static void pcp_refill(struct buddy_arena *a, pcp_cache_t *pcp, int rank) {
+    int batch[PCP_BATCH];
+    arena_lock(a);
+    int n = alloc_blocks(a, rank, PCP_BATCH, batch);
+    for (int i = 0; i < n; i++) {
+        store_meta(a, batch[i], META_CACHED | rank);
+        pcp->blocks[rank][n - 1 - i] = batch[i];
+    }
+    arena_unlock(a);
+
+    pcp->count[rank] = n;
+    __atomic_add_fetch(&a->pcp_cached, n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&a->pcp_pages, (long)n << (rank - 1), __ATOMIC_RELAXED);
+}
+
+// Return the n oldest blocks of a cache to the core
+static void pcp_drain(struct buddy_arena *a, pcp_cache_t *pcp, int rank, int n) {
+    int *blocks = pcp->blocks[rank];
+    arena_lock(a);
+    for (int i = 0; i < n; i++) {
+        free_block(a, blocks[i], rank);
+    }
+    arena_unlock(a);
+
+    pcp->count[rank] -= n;
+    memmove(blocks, blocks + n, pcp->count[rank] * sizeof(int));
+    __atomic_sub_fetch(&a->pcp_cached, n, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&a->pcp_pages, (long)n << (rank - 1), __ATOMIC_RELAXED);
+}
+
+// Flush every per-CPU cache into the core. Returns 0 if they were all empty.
+static int pcp_drain_all(struct buddy_arena *a) {
+    if (__atomic_load_n(&a->pcp_cached, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+    for (int slot = 0; slot < PCP_SLOTS; slot++) {
+        pcp_cache_t *pcp = &a->pcp[slot];
+        pcp_lock(pcp);
+        for (int rank = 1; rank <= BUDDY_PCP_MAX_RANK; rank++) {
+            if (pcp->count[rank] > 0) {
+                pcp_drain(a, pcp, rank, pcp->count[rank]);
+            }
+        }
+        pcp_unlock(pcp);
+    }
+    return 1;
+}
+
+// Per-CPU fast path of alloc, NO_PAGE if it has to go to the core
+static int pcp_alloc(struct buddy_arena *a, int rank) {
+    pcp_cache_t *pcp = pcp_trylock(a);
+    if (pcp == NULL) {
+        return NO_PAGE;
+    }
+
+    if (pcp->count[rank] == 0) {
+        pcp_refill(a, pcp, rank);
+    }
+    int page_idx = NO_PAGE;
+    if (pcp->count[rank] > 0) {
+        page_idx = pcp->blocks[rank][--pcp->count[rank]];
+        store_meta(a, page_idx, rank);
+        __atomic_sub_fetch(&a->pcp_cached, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&a->pcp_pages, 1L << (rank - 1), __ATOMIC_RELAXED);
+    }
+    pcp_unlock(pcp);
+    return page_idx;
+}
+
+#ifndef BUDDY_DEFERRED_FREE
+// Per-CPU fast path of free. Returns 1 if the block was cached, 0 if it has
+// to go to the core, or -EINVAL if a racing free of it got there first.
+static int pcp_free(struct buddy_arena *a, int page_idx, int rank) {
+    pcp_cache_t *pcp = pcp_trylock(a);
+    if (pcp == NULL) {
+        return 0;
+    }
+
+    if (pcp->count[rank] == PCP_HIGH) {
+        pcp_drain(a, pcp, rank, PCP_BATCH);
+    }
+    // Claim the block as deferred_free does, so only one of two frees caches it
+    page_meta_t meta = rank;
+    if (!__atomic_compare_exchange_n(&a->page_metadata[page_idx], &meta, META_CACHED | rank,
+                                     0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        pcp_unlock(pcp);
+        return -EINVAL;
+    }
+#ifdef BUDDY_CHECKED
+    bump_tag(a, page_idx);
+#endif
+    pcp->blocks[rank][pcp->count[rank]++] = page_idx;
+    __atomic_add_fetch(&a->pcp_cached, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&a->pcp_pages, 1L << (rank - 1), __ATOMIC_RELAXED);
+    pcp_unlock(pcp);
+    return 1;
+}
+#endif
+#else
+#define arena_lock(a) ((void)(a))
+#define arena_unlock(a) ((void)(a))
+#endif
+
+buddy_arena_t *buddy_arena_attach(void *p, int pgcount, const buddy_arena_config_t *cfg) {
+    struct buddy_arena *a = arena_open(p, pgcount, cfg, 1);
+    if (IS_ERR(a)) {
+        return a;
+    }
+
+#ifdef BUDDY_THREAD_SAFE
+    // The previous owner may have died holding a lock; nobody else runs yet
+    pthread_mutex_init(&a->lock, NULL);
+    arena_lock(a);
+    // Per-CPU caches belong to threads that are gone; hand their blocks back
+    for (int slot = 0; slot < PCP_SLOTS; slot++) {
+        pcp_cache_t *pcp = &a->pcp[slot];
+        for (int rank = 1; rank <= BUDDY_PCP_MAX_RANK; rank++) {
+            for (int i = 0; i < pcp->count[rank]; i++) {
+                free_block(a, pcp->blocks[rank][i], rank);
+            }
+            pcp->count[rank] = 0;
+        }
+        pcp->locked = 0;
+    }
+    a->pcp_cached = 0;
+    a->pcp_pages = 0;
+    arena_unlock(a);
+#endif
+    return a;
+}
+
+// Count an allocation that failed for lack of space
+static void count_enospc(struct buddy_arena *a) {
+    __atomic_add_fetch(&a->enospc, 1, __ATOMIC_RELAXED);
+}
+
+void *buddy_arena_alloc(buddy_arena_t *a, int rank) {
+    if (rank < 1 || rank > a->max_rank) {
+        return ERR_PTR(-EINVAL);
+    }
+    TRACE(ALLOC_ENTER, rank, 0, 0);
+
+#ifdef BUDDY_THREAD_SAFE
+    if (rank <= BUDDY_PCP_MAX_RANK) {
+        int page_idx = pcp_alloc(a, rank);
+        if (page_idx != NO_PAGE) {
+            TRACE(ALLOC_EXIT, rank, rank, page_idx);
+            return get_page_addr(a, page_idx);
+        }
+    }
+#endif
+
+    arena_lock(a);
+    int page_idx = alloc_block(a, rank);
+    arena_unlock(a);
+
+#ifdef BUDDY_THREAD_SAFE
+    // Blocks parked in the per-CPU caches may still satisfy the request
+    if (page_idx < 0 && pcp_drain_all(a)) {
+        arena_lock(a);
+        page_idx = alloc_block(a, rank);
+        arena_unlock(a);
+    }
+#endif
+
+    if (page_idx < 0) {
+        count_enospc(a);
+        TRACE(ALLOC_EXIT, rank, 0, page_idx);
+        return ERR_PTR(page_idx);
+    }
+    TRACE(ALLOC_EXIT, rank, TRACE_SOURCED_RANK, page_idx);
+    return get_page_addr(a, page_idx);
+}
+
+// Free a block. A non-NULL tag must match the block's generation; tagged
+// frees skip the lock-free paths so the check and the bump that follows
+// the free happen under the arena lock.
+static int arena_free(struct buddy_arena *a, void *p, const unsigned int *tag) {
+    if (p == NULL) {
+        return -EINVAL;
+    }
+
+    int page_idx = get_page_index(a, p);
+    if (page_idx < 0) {
+        return -EINVAL;
+    }
+    (void)tag;   // Only BUDDY_CHECKED builds pass one
+
+#ifdef BUDDY_DEFERRED_FREE
+    if (tag == NULL && deferred_free(a, page_idx)) {
+        return OK;
+    }
+#elif defined(BUDDY_THREAD_SAFE)
+    // An allocated head carries its plain rank, without any flag bits
+    page_meta_t cached = load_meta(a, page_idx);
+    if (tag == NULL && cached >= 1 && cached <= BUDDY_PCP_MAX_RANK) {
+        int ret = pcp_free(a, page_idx, cached);
+        if (ret != 0) {
+            return ret < 0 ? ret : OK;
+        }
+    }
+#endif
+
+    arena_lock(a);
+    page_meta_t meta = load_meta(a, page_idx);
+    int rank = meta_rank(meta);
+    if (rank == 0 || (meta & (META_FREE | META_CACHED))) {
+        arena_unlock(a);
+        return -EINVAL;
+    }
+#ifdef BUDDY_CHECKED
+    if (rank > a->max_rank || !is_aligned(a, page_idx, rank) ||
+        (tag != NULL && page_tag(a, page_idx) != *tag)) {
+        arena_unlock(a);
+        return -EINVAL;
+    }
+#endif
+    if (!claim_meta(a, page_idx, meta)) {
+        arena_unlock(a);
+        return -EINVAL;
+    }
+#ifdef BUDDY_CHECKED
+    bump_tag(a, page_idx);
+#endif
+
+    if (meta & META_RUN) {
+        free_run(a, page_idx, rank);
+    } else {
+#ifdef BUDDY_LAZY
+        lazy_free(a, page_idx, rank);
+#else
+        free_block(a, page_idx, rank);
+#endif
+    }
+    arena_unlock(a);
+
+    return OK;
+}
+
+int buddy_arena_free(buddy_arena_t *a, void *p) {
+    return arena_free(a, p, NULL);
+}
+
+// Allocate the smallest block covering the given number of pages. With
+// trimming, the block is cut into the pieces that cover exactly those
+// pages, largest first, and the unused tail goes back to the free lists.
+static int alloc_run(struct buddy_arena *a, int pages, int trim) {
+    int rank = pages == 1 ? 1 : 33 - __builtin_clz(pages - 1);
+    int page_idx = alloc_block(a, rank);
+    if (page_idx < 0 || !trim || pages == 1 << (rank - 1)) {
+        return page_idx;
+    }
+
+    int start = page_idx;
+    int remaining = pages;
+    int pieces = 0;
+    page_meta_t state = META_RUN;
+    while (remaining > 0) {
+        int piece_rank = 32 - __builtin_clz(remaining);
+        store_meta(a, start, state | piece_rank);
+        start += 1 << (piece_rank - 1);
+        remaining -= 1 << (piece_rank - 1);
+        state = META_RUN_TAIL;
+        pieces++;
+    }
+    pieces += free_range(a, page_idx, start, page_idx + (1 << (rank - 1)));
+    a->splits += pieces - 1;
+
+    return page_idx;
+}
+
+void *buddy_arena_alloc_bytes(buddy_arena_t *a, size_t bytes, int flags) {
+    // Bound bytes before rounding up, which would wrap near SIZE_MAX
+    if (bytes == 0 || bytes > (size_t)1 << (a->max_rank - 1 + a->page_shift)) {
+        return ERR_PTR(-EINVAL);
+    }
+    size_t pages = (bytes + ((size_t)1 << a->page_shift) - 1) >> a->page_shift;
+
+    arena_lock(a);
+    int page_idx = alloc_run(a, (int)pages, flags & BUDDY_TRIM);
+    arena_unlock(a);
+
+#ifdef BUDDY_THREAD_SAFE
+    if (page_idx < 0 && pcp_drain_all(a)) {
+        arena_lock(a);
+        page_idx = alloc_run(a, (int)pages, flags & BUDDY_TRIM);
+        arena_unlock(a);
+    }
+#endif
+
+    if (page_idx < 0) {
+        count_enospc(a);
+        return ERR_PTR(page_idx);
+    }
+    return get_page_addr(a, page_idx);
+}
+
+// Grow a block in place to new_rank by absorbing its upper buddies, which
+// works while the block is the lower half at every step and each buddy is
+// a whole free block. Returns 0 if the block stays where it is.
+static int grow_block(struct buddy_arena *a, int page_idx, int rank, int new_rank) {
+    for (int r = rank; r < new_rank; r++) {
+        int buddy_idx = page_idx + (1 << (r - 1));
+        if (!is_aligned(a, page_idx, r + 1) || buddy_idx >= a->total_pages ||
+            !block_is_free(a, buddy_idx, r)) {
+            return 0;
+        }
+    }
+    for (int r = rank; r < new_rank; r++) {
+        int buddy_idx = page_idx + (1 << (r - 1));
+        remove_from_free_list(a, buddy_idx, r);
+        store_meta(a, buddy_idx, 0);
+    }
+    a->merges += new_rank - rank;
+    store_meta(a, page_idx, new_rank);
+    warm_pages(a, page_idx + (1 << (rank - 1)), (1 << (new_rank - 1)) - (1 << (rank - 1)));
+    return 1;
+}
+
+// Resize an allocated block. Shrinking always happens in place; growing
+// falls back to alloc, copy and free when the buddies are not free.
+static int resize_block(struct buddy_arena *a, int page_idx, int rank, int new_rank) {
+    if (new_rank < rank) {
+        // Release the upper halves, each the buddy of what stays allocated
+        store_meta(a, page_idx, new_rank);
+        a->splits += free_range(a, page_idx, page_idx + (1 << (new_rank - 1)),
+                                page_idx + (1 << (rank - 1)));
+        return 1;
+    }
+
+    int grown = grow_block(a, page_idx, rank, new_rank);
+#ifdef BUDDY_LAZY
+    // Parked buddies only count once coalesced
+    if (!grown && a->lazy_total > 0) {
+        lazy_flush_all(a);
+        grown = grow_block(a, page_idx, rank, new_rank);
+    }
+#endif
+    return grown;
+}
+
+void *buddy_arena_realloc(buddy_arena_t *a, void *p, int new_rank) {
+    if (p == NULL || new_rank < 1 || new_rank > a->max_rank) {
+        return ERR_PTR(-EINVAL);
+    }
+    int page_idx = get_page_index(a, p);
+    if (page_idx < 0) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    arena_lock(a);
+    page_meta_t meta = load_meta(a, page_idx);
+    int rank = meta_rank(meta);
+    // Only plain blocks; trimmed alloc_bytes runs are not buddy-sized
+    if (rank == 0 || (meta & ~META_RANK_MASK)) {
+        arena_unlock(a);
+        return ERR_PTR(-EINVAL);
+    }
+    int in_place = new_rank == rank || resize_block(a, page_idx, rank, new_rank);
+    arena_unlock(a);
+    if (in_place) {
+        return p;
+    }
+
+    // The original block stays valid if this fails
+    void *q = buddy_arena_alloc(a, new_rank);
+    if (IS_ERR(q)) {
+        return q;
+    }
+    memcpy(q, p, (size_t)1 << (rank - 1 + a->page_shift));
+    buddy_arena_free(a, p);
+    return q;
+}
+
+// Small objects come from slabs: buddy blocks cut into equal cache-line
+// multiples, so alloc and free of an object only pop and push a free list
+// under the arena lock and never split or merge. The core sees each slab as
+// one allocated block; what the slab holds is kept in a header at its
+// start, as every state of the page metadata byte is taken. The header
+// ends in a bitmap of live objects, so frees of anything but a live object
+// are refused, and the objects follow from the next cache line. Objects
+// are carved in address order the first time round, so a new slab costs
+// nothing up front, and freed objects are linked through their first
+// bytes. Slabs with free objects sit on their class's partial list, the
+// others on its full list. An emptied slab goes back to the core unless it
+// is the last partial one of its class.
+#define SLAB_MIN_OBJECTS 8       // Slabs are sized to hold at least this many
+#define SLAB_MAGIC 0x736c6162    // "slab", xored with the slab's page index
+
+static const int slab_sizes[SLAB_CLASSES] = {
+    64, 128, 192, 256, 320, 384, 448, 512, 768, 1024, 1536, 2048,
+};
+
+typedef struct {
+    uint32_t magic;
+    int size_class;
+    int capacity;       // Objects the slab holds
+    int offset;         // Byte offset of the first object
+    int inuse;
+    int carved;         // Objects handed out at least once; the rest are untouched
+    int free_obj;       // First object on the free list, NO_PAGE if none
+    int rank;           // Rank of the block, which its metadata does not carry
+    int next;           // Slab list links, page indices
+    int prev;
+    uint64_t live[];    // Bit per object, set while it is allocated
+} slab_header_t;
+
+// Helper function to get the size class serving a request, -1 if too large
+static int slab_class(size_t size) {
+    if (size == 0 || size > 2048) {
+        return -1;
+    }
+    if (size <= 512) {
+        return (int)((size - 1) >> 6);
+    }
+    return 8 + (size > 768) + (size > 1024) + (size > 1536);
+}
+
+// Helper function to get the rank of the slabs of a class in an arena
+static int slab_rank(struct buddy_arena *a, int size_class) {
+    size_t bytes = CACHE_LINE + (size_t)SLAB_MIN_OBJECTS * slab_sizes[size_class];
+    size_t pages = (bytes + ((size_t)1 << a->page_shift) - 1) >> a->page_shift;
+    int rank = pages == 1 ? 1 : 65 - __builtin_clzll(pages - 1);
+    // Small arenas make do with fewer objects per slab
+    return rank < a->max_rank ? rank : a->max_rank;
+}
+
+// Helper function to get the byte offset of the first object in a slab
+// and how many objects fit behind the header and its bitmap
+static size_t slab_layout(struct buddy_arena *a, int size_class, int rank, int *capacity) {
+    size_t bytes = (size_t)1 << (rank - 1 + a->page_shift);
+    size_t size = slab_sizes[size_class];
+    // A bitmap sized for the objects that fit without it covers the rest
+    size_t most = (bytes - CACHE_LINE) / size;
+    size_t offset = ALIGN_UP(sizeof(slab_header_t) + (most + 63) / 64 * sizeof(uint64_t), CACHE_LINE);
+    *capacity = offset < bytes ? (int)((bytes - offset) / size) : 0;
+    return offset;
+}
+
+static slab_header_t *slab_header(struct buddy_arena *a, int page_idx) {
+    return (slab_header_t *)get_page_addr(a, page_idx);
+}
+
+// Helper function to get the rank of the block at a head page, slabs included
+static int head_rank(struct buddy_arena *a, int page_idx, page_meta_t meta) {
+    return meta == META_SLAB ? slab_header(a, page_idx)->rank : meta_rank(meta);
+}
+
+static void *slab_object(struct buddy_arena *a, int page_idx, int obj) {
+    slab_header_t *slab = slab_header(a, page_idx);
+    return (char *)slab + slab->offset + (size_t)obj * slab_sizes[slab->size_class];
+}
+
+// Helper to push a slab onto the head of a slab list
+static void slab_push(struct buddy_arena *a, int *list, int page_idx) {
+    slab_header_t *slab = slab_header(a, page_idx);
+    slab->next = *list;
+    slab->prev = NO_PAGE;
+    if (*list != NO_PAGE) {
+        slab_header(a, *list)->prev = page_idx;
+    }
+    *list = page_idx;
+}
+
+// Helper to remove a slab from the slab list it is on
+static void slab_unlink(struct buddy_arena *a, int *list, int page_idx) {
+    slab_header_t *slab = slab_header(a, page_idx);
+    if (slab->prev != NO_PAGE) {
+        slab_header(a, slab->prev)->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next != NO_PAGE) {
+        slab_header(a, slab->next)->prev = slab->prev;
+    }
+}
+
+// Take an object of a class, starting a new slab if none has room.
+// Called with the arena lock held. Returns NULL for -ENOSPC.
+static void *slab_alloc(struct buddy_arena *a, int size_class) {
+    int page_idx = a->slab_partial[size_class];
+    slab_header_t *slab;
+
+    if (page_idx == NO_PAGE) {
+        int rank = slab_rank(a, size_class);
+        int capacity;
+        size_t offset = slab_layout(a, size_class, rank, &capacity);
+        if (capacity == 0) {
+            return NULL;
+        }
+        page_idx = alloc_block(a, rank);
+        if (page_idx < 0) {
+            return NULL;
+        }
+        store_meta(a, page_idx, META_SLAB);
+        slab = slab_header(a, page_idx);
+        slab->magic = SLAB_MAGIC ^ page_idx;
+        slab->size_class = size_class;
+        slab->rank = rank;
+        slab->capacity = capacity;
+        slab->offset = (int)offset;
+        memset(slab->live, 0, (capacity + 63) / 64 * sizeof(uint64_t));
+        slab->inuse = 0;
+        slab->carved = 0;
+        slab->free_obj = NO_PAGE;
+        slab_push(a, &a->slab_partial[size_class], page_idx);
+    } else {
+        slab = slab_header(a, page_idx);
+    }
+
+    int obj;
+    if (slab->free_obj != NO_PAGE) {
+        obj = slab->free_obj;
+        slab->free_obj = *(int *)slab_object(a, page_idx, obj);
+    } else {
+        obj = slab->carved++;
+    }
+    slab->live[obj / 64] |= 1ULL << (obj % 64);
+    if (++slab->inuse == slab->capacity) {
+        slab_unlink(a, &a->slab_partial[size_class], page_idx);
+        slab_push(a, &a->slab_full[size_class], page_idx);
+    }
+    return slab_object(a, page_idx, obj);
+}
+
+void *buddy_arena_alloc_small(buddy_arena_t *a, size_t size) {
+    int size_class = slab_class(size);
+    if (size_class < 0) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    arena_lock(a);
+    void *p = slab_alloc(a, size_class);
+    arena_unlock(a);
+
+#ifdef BUDDY_THREAD_SAFE
+    if (p == NULL && pcp_drain_all(a)) {
+        arena_lock(a);
+        p = slab_alloc(a, size_class);
+        arena_unlock(a);
+    }
+#endif
+
+    if (p == NULL) {
+        count_enospc(a);
+        return ERR_PTR(-ENOSPC);
+    }
+    return p;
+}
+
+int buddy_arena_free_small(buddy_arena_t *a, void *p) {
+    if (p == NULL || (char *)p < (char *)a->base_addr) {
+        return -EINVAL;
+    }
+    long offset = ((char *)p - (char *)a->base_addr) >> a->page_shift;
+    if (offset >= a->total_pages) {
+        return -EINVAL;
+    }
+
+    arena_lock(a);
+    int page_idx = find_block_head(a, (int)offset);
+    if (load_meta(a, page_idx) != META_SLAB) {
+        arena_unlock(a);
+        return -EINVAL;
+    }
+    // p must be an object boundary inside a slab, and the object live
+    slab_header_t *slab = slab_header(a, page_idx);
+    int size_class = slab->size_class;
+    if (slab->magic != (SLAB_MAGIC ^ (uint32_t)page_idx) || size_class < 0 ||
+        size_class >= SLAB_CLASSES || slab->rank != slab_rank(a, size_class)) {
+        arena_unlock(a);
+        return -EINVAL;
+    }
+    long byte = (char *)p - (char *)slab_object(a, page_idx, 0);
+    int obj = byte / slab_sizes[size_class];
+    if (byte < 0 || byte % slab_sizes[size_class] != 0 || obj >= slab->carved ||
+        !(slab->live[obj / 64] & (1ULL << (obj % 64)))) {
+        arena_unlock(a);
+        return -EINVAL;
+    }
+
+    int rank = slab->rank;
+    slab->live[obj / 64] &= ~(1ULL << (obj % 64));
+    if (slab->inuse-- == slab->capacity) {
+        slab_unlink(a, &a->slab_full[size_class], page_idx);
+        slab_push(a, &a->slab_partial[size_class], page_idx);
+    }
+    if (slab->inuse == 0 && (slab->next != NO_PAGE || slab->prev != NO_PAGE)) {
+        // Keep one partial slab per class so a lone object does not thrash
+        slab_unlink(a, &a->slab_partial[size_class], page_idx);
+        slab->magic = 0;
+        free_block(a, page_idx, rank);
+    } else {
+        *(int *)p = slab->free_obj;
+        slab->free_obj = obj;
+    }
+    arena_unlock(a);
+    return OK;
+}
+
+#define BULK_CHUNK 64
+
+int buddy_arena_alloc_bulk(buddy_arena_t *a, int rank, int n, void **out) {
+    if (rank < 1 || rank > a->max_rank || n < 0 || (n > 0 && out == NULL)) {
+        return -EINVAL;
+    }
+
+    int chunk[BULK_CHUNK];
+    int done = 0;
+    arena_lock(a);
+    while (done < n) {
+        int want = n - done < BULK_CHUNK ? n - done : BULK_CHUNK;
+        int got = alloc_blocks(a, rank, want, chunk);
+        for (int i = 0; i < got; i++) {
+            out[done++] = get_page_addr(a, chunk[i]);
+        }
+        if (got < want) {
+#ifdef BUDDY_THREAD_SAFE
+            // Blocks parked in the per-CPU caches may cover the rest
+            arena_unlock(a);
+            int drained = pcp_drain_all(a);
+            arena_lock(a);
+            if (drained) continue;
+#endif
+            break;
+        }
+    }
+    arena_unlock(a);
+
+    if (done < n) {
+        count_enospc(a);
+    }
+    return done;
+}
+
+// A run of contiguous blocks from a bulk free that has not reached the
+// free lists yet
+typedef struct {
+    int page_idx;
+    int rank;
+} pending_block_t;
+
+#define PENDING_MAX (2 * RANK_LIMIT + 2)
+
+static void flush_pending(struct buddy_arena *a, pending_block_t *pending, int depth) {
+    for (int i = 0; i < depth; i++) {
+        free_block(a, pending[i].page_idx, pending[i].rank);
+    }
+}
+
+int buddy_arena_free_bulk(buddy_arena_t *a, void **ptrs, int n) {
+    if (n < 0 || (n > 0 && ptrs == NULL)) {
+        return -EINVAL;
+    }
+
+    pending_block_t pending[PENDING_MAX];
+    int depth = 0;
+    int ret = OK;
+
+    arena_lock(a);
+    for (int i = 0; i < n; i++) {
+        int page_idx = ptrs[i] == NULL ? -1 : get_page_index(a, ptrs[i]);
+        if (page_idx < 0) {
+            ret = -EINVAL;
+            continue;
+        }
+
+        page_meta_t meta = load_meta(a, page_idx);
+        int rank = meta_rank(meta);
+        if (rank == 0 || (meta & (META_FREE | META_CACHED))) {
+            ret = -EINVAL;
+            continue;
+        }
+#ifdef BUDDY_CHECKED
+        if (rank > a->max_rank || !is_aligned(a, page_idx, rank)) {
+            ret = -EINVAL;
+            continue;
+        }
+#endif
+        if (!claim_meta(a, page_idx, meta)) {
+            ret = -EINVAL;
+            continue;
+        }
+#ifdef BUDDY_CHECKED
+        bump_tag(a, page_idx);
+#endif
+
+        // Trimmed runs are not buddy-sized; free them right away
+        if (meta & META_RUN) {
+            free_run(a, page_idx, rank);
+            continue;
+        }
+
+        if (depth > 0) {
+            pending_block_t *top = &pending[depth - 1];
+            int run_end = top->page_idx + (1 << (top->rank - 1));
+
+            // Anything inside the pending run was already freed by this call
+            if (page_idx >= pending[0].page_idx && page_idx < run_end) {
+                ret = -EINVAL;
+                continue;
+            }
+            // Only a block right after the run can extend it
+            if (page_idx != run_end || depth == PENDING_MAX) {
+                flush_pending(a, pending, depth);
+                depth = 0;
+            }
+        }
+
+        // Merge buddy pairs at the top of the run without touching the free lists
+        pending[depth].page_idx = page_idx;
+        pending[depth].rank = rank;
+        depth++;
+        while (depth >= 2) {
+            pending_block_t *lower = &pending[depth - 2];
+            pending_block_t *upper = &pending[depth - 1];
+            if (lower->rank != upper->rank || lower->rank == a->max_rank ||
+                !is_aligned(a, lower->page_idx, lower->rank + 1)) {
+                break;
+            }
+            store_meta(a, upper->page_idx, 0);
+            lower->rank++;
+            depth--;
+            a->merges++;
+        }
+    }
+    flush_pending(a, pending, depth);
+    arena_unlock(a);
+
+    return ret;
+}
+
+int buddy_arena_query_ranks(buddy_arena_t *a, void *p) {
+    int page_idx = get_page_index(a, p);
+    if (page_idx < 0) {
+        return -EINVAL;
+    }
+
+#ifdef BUDDY_THREAD_SAFE
+    // A free or parked block may still merge with blocks that sit in a
+    // per-CPU cache; flush them to report the coalesced view.
+    if (load_meta(a, find_block_head(a, page_idx)) & (META_FREE | META_CACHED)) {
+        pcp_drain_all(a);
+    }
+#endif
+
+    arena_lock(a);
+    page_meta_t meta = load_meta(a, find_block_head(a, page_idx));
+#ifdef BUDDY_LAZY
+    // Report the block a free or parked page would belong to once coalesced
+    if (meta & (META_FREE | META_CACHED)) {
+        lazy_flush_all(a);
+        meta = load_meta(a, find_block_head(a, page_idx));
+    }
+#endif
+    arena_unlock(a);
+
+    // Slabs are not blocks the caller owns
+    if (meta == META_SLAB) {
+        return -EINVAL;
+    }
+    // Free or allocated, the answer is the rank of the containing block
+    return meta_rank(meta);
+}
+
+int buddy_arena_query_page_counts(buddy_arena_t *a, int rank) {
+    if (rank < 1 || rank > a->max_rank) {
+        return -EINVAL;
+    }
+
+#ifdef BUDDY_THREAD_SAFE
+    pcp_drain_all(a);
+#endif
+
+    arena_lock(a);
+#ifdef BUDDY_LAZY
+    lazy_flush_all(a);
+#endif
+    int count = a->free_counts[rank];
+    arena_unlock(a);
+    return count;
+}
+
+void *buddy_arena_alloc_tagged(buddy_arena_t *a, int rank, unsigned int *tag) {
+    if (tag == NULL) {
+        return ERR_PTR(-EINVAL);
+    }
+    void *p = buddy_arena_alloc(a, rank);
+#ifdef BUDDY_CHECKED
+    *tag = IS_ERR(p) ? 0 : page_tag(a, get_page_index(a, p));
+#else
+    *tag = 0;
+#endif
+    return p;
+}
+
+int buddy_arena_free_tagged(buddy_arena_t *a, void *p, unsigned int tag) {
+#ifdef BUDDY_CHECKED
+    return arena_free(a, p, &tag);
+#else
+    (void)tag;
+    return buddy_arena_free(a, p);
+#endif
+}
+
+typedef void (*free_block_fn)(struct buddy_arena *a, int page_idx, int rank, void *ctx);
+
+// Call fn for every free block of min_rank or larger. fn must leave the
+// free lists alone. Called with the arena lock held.
+static void for_each_free_block(struct buddy_arena *a, int min_rank, free_block_fn fn, void *ctx) {
+    for (int rank = min_rank; rank <= a->max_rank; rank++) {
+        if (a->free_counts[rank] == 0) continue;
+#ifdef BUDDY_ADDRESS_ORDERED
+        int block_size = 1 << (rank - 1);
+        size_t words = bitmap_words(a->total_pages, rank);
+        for (size_t w = 0; w < words; w++) {
+            for (uint64_t bits = a->free_bits[rank][w]; bits != 0; bits &= bits - 1) {
+                int bit = w * 64 + __builtin_ctzll(bits);
+                fn(a, (bit << (rank - 1)) + (-a->align_off & (block_size - 1)), rank, ctx);
+            }
+        }
+#else
+        for (int page_idx = a->free_lists[rank]; page_idx != NO_PAGE;) {
+            int next = list_links(a, page_idx)->next;
+            fn(a, page_idx, rank, ctx);
+            page_idx = next;
+        }
+#endif
+    }
+}
+
+typedef struct {
+    size_t granule;
+    int advice;
+    long released;   // Pages
+} release_ctx_t;
+
+// Helper function to get the pages lying wholly inside [start, end)
+static int pages_within(struct buddy_arena *a, uintptr_t start, uintptr_t end, int *first) {
+    size_t page_size = (size_t)1 << a->page_shift;
+    uintptr_t base = (uintptr_t)a->base_addr;
+    *first = (start - base + page_size - 1) >> a->page_shift;
+    int last = (end - base) >> a->page_shift;
+    return last > *first ? last - *first : 0;
+}
+
+// Helper function to madvise [start, end) and mark its pages cold
+static void release_span(struct buddy_arena *a, release_ctx_t *rc, uintptr_t start, uintptr_t end) {
+    if (start < end && madvise((void *)start, end - start, rc->advice) == 0) {
+        int first;
+        int n = pages_within(a, start, end, &first);
+        cold_range(a, first, n, 1);
+        rc->released += (end - start) >> a->page_shift;
+    }
+}
+
+// Give the backing of the whole granules inside a free block back to the
+// OS, skipping granules that are cold already
+static void release_block(struct buddy_arena *a, int page_idx, int rank, void *ctx) {
+    release_ctx_t *rc = ctx;
+    uintptr_t start = (uintptr_t)get_page_addr(a, page_idx);
+    uintptr_t end = start + ((size_t)1 << (rank - 1 + a->page_shift));
+    start = ALIGN_UP(start, rc->granule);
+    end &= ~(uintptr_t)(rc->granule - 1);
+#if LINKS_IN_POOL
+    // The free lists still need the head's links once its page is gone
+    if (!cold_range(a, page_idx, 1, 0)) {
+        a->cold_links[page_idx] = *get_links(a, page_idx);
+    }
+#endif
+
+    // One madvise per run of granules that still have resident pages
+    uintptr_t span = start;
+    for (uintptr_t g = start; g < end; g += rc->granule) {
+        int first;
+        int n = pages_within(a, g, g + rc->granule, &first);
+        if (n > 0 && cold_range(a, first, n, 0)) {
+            release_span(a, rc, span, g);
+            span = g + rc->granule;
+        }
+    }
+    release_span(a, rc, span, end);
+}
+
+int buddy_arena_release(buddy_arena_t *a, int min_rank, size_t granule, int flags) {
+    if (min_rank < 1 || min_rank > a->max_rank || granule < ((size_t)1 << a->page_shift) ||
+        (granule & (granule - 1)) || (flags & ~BUDDY_RELEASE_LAZY)) {
+        return -EINVAL;
+    }
+
+#ifdef BUDDY_THREAD_SAFE
+    pcp_drain_all(a);
+#endif
+
+    release_ctx_t rc = {
+        .granule = granule,
+        .advice = (flags & BUDDY_RELEASE_LAZY) ? MADV_FREE : MADV_DONTNEED,
+    };
+    arena_lock(a);
+#ifdef BUDDY_LAZY
+    lazy_flush_all(a);
+#endif
+    for_each_free_block(a, min_rank, release_block, &rc);
+    arena_unlock(a);
+
+    return rc.released > INT32_MAX ? INT32_MAX : (int)rc.released;
+}
+
+// Walk the whole pool and cross-check the metadata, the free lists and
+// the buddy invariants. Returns the number of problems found.
+int buddy_arena_check(buddy_arena_t *a) {
+    int errors = 0;
+    int free_seen[RANK_LIMIT + 1] = {0};
+
+    arena_lock(a);
+
+    // Blocks tile the pool: every block starts at an aligned head of a valid
+    // rank, and its other pages are interior
+    page_meta_t prev = 0;
+    for (int page_idx = 0; page_idx < a->total_pages;) {
+        page_meta_t meta = load_meta(a, page_idx);
+        int rank = head_rank(a, page_idx, meta);
+        if (meta == META_SLAB && slab_header(a, page_idx)->magic != (SLAB_MAGIC ^ (uint32_t)page_idx)) {
+            errors++;
+            break;
+        }
+        if (rank < 1 || rank > a->max_rank || !is_aligned(a, page_idx, rank) ||
+            page_idx + (1 << (rank - 1)) > a->total_pages) {
+            errors++;
+            break;   // The block size is unknown, so the walk cannot go on
+        }
+        int block_size = 1 << (rank - 1);
+        for (int i = 1; i < block_size; i++) {
+            if (load_meta(a, page_idx + i) != 0) {
+                errors++;
+                break;
+            }
+        }
+
+        if (meta & META_FREE) {
+            free_seen[rank]++;
+            // Only the rank may go with the free bit
+            if (meta != (META_FREE | rank)) {
+                errors++;
+            }
+            // Free buddies of the same rank should have been merged
+            int buddy_idx = get_buddy_index(a, page_idx, rank);
+            if (rank < a->max_rank && buddy_idx > page_idx && buddy_idx < a->total_pages &&
+                load_meta(a, buddy_idx) == (META_FREE | rank)) {
+                errors++;
+            }
+        }
+        // Later pieces of a trimmed run only follow other pieces of it
+        if ((meta & ~META_RANK_MASK) == META_RUN_TAIL && (!(prev & META_RUN) || prev == META_SLAB)) {
+            errors++;
+        }
+        prev = meta;
+        page_idx += block_size;
+    }
+
+    for (int rank = 1; rank <= a->max_rank; rank++) {
+        if (free_seen[rank] != a->free_counts[rank] ||
+            !(a->free_mask & (1u << rank)) != (a->free_counts[rank] == 0)) {
+            errors++;
+        }
+
+        // Every entry of the free structure is a free head of its rank
+        int listed = 0;
+#ifdef BUDDY_ADDRESS_ORDERED
+        size_t words = bitmap_words(a->total_pages, rank);
+        int block_size = 1 << (rank - 1);
+        for (size_t w = 0; w < words; w++) {
+            for (uint64_t bits = a->free_bits[rank][w]; bits != 0; bits &= bits - 1) {
+                long page_idx = (long)(w * 64 + __builtin_ctzll(bits)) * block_size +
+                                (-a->align_off & (block_size - 1));
+                if (page_idx >= a->total_pages || load_meta(a, page_idx) != (META_FREE | rank)) {
+                    errors++;
+                }
+                listed++;
+            }
+        }
+#ifdef BUDDY_BITMAP_TREE
+        // A summary bit is set exactly when the word below it is non-zero
+        uint64_t *below = a->free_bits[rank];
+        for (int level = 0; level < a->free_depth[rank]; level++) {
+            for (size_t w = 0; w < words; w++) {
+                int summary = (a->free_tree[rank][level][w / 64] >> (w % 64)) & 1;
+                if (summary != (below[w] != 0)) {
+                    errors++;
+                }
+            }
+            below = a->free_tree[rank][level];
+            words = (words + 63) / 64;
+        }
+#endif
+#else
+        int expect_prev = NO_PAGE;
+        for (int page_idx = a->free_lists[rank]; page_idx != NO_PAGE;) {
+            if (page_idx < 0 || page_idx >= a->total_pages || listed > a->free_counts[rank] ||
+                load_meta(a, page_idx) != (META_FREE | rank) ||
+                list_links(a, page_idx)->prev != expect_prev) {
+                errors++;
+                break;   // Do not follow a corrupt list any further
+            }
+            listed++;
+            expect_prev = page_idx;
+            page_idx = list_links(a, page_idx)->next;
+        }
+#endif
+        if (listed != a->free_counts[rank]) {
+            errors++;
+        }
+
+#ifdef BUDDY_LAZY
+        // Parked blocks are cached heads of their rank
+        int parked = 0;
+        for (int page_idx = a->lazy_lists[rank]; page_idx != NO_PAGE && parked <= a->lazy_counts[rank];) {
+            if (page_idx < 0 || page_idx >= a->total_pages || load_meta(a, page_idx) != (META_CACHED | rank)) {
+                errors++;
+                break;
+            }
+            parked++;
+            page_idx = get_links(a, page_idx)->next;
+        }
+        if (parked != a->lazy_counts[rank]) {
+            errors++;
+        }
+#endif
+    }
+    arena_unlock(a);
+
+    return errors;
+}
+
+int buddy_arena_stats(buddy_arena_t *a, buddy_stats_t *out) {
+    if (out == NULL) {
+        return -EINVAL;
+    }
+    memset(out, 0, sizeof(*out));
+    size_t page_size = (size_t)1 << a->page_shift;
+
+    // A snapshot of the counters; nothing is drained or walked
+    long free_pages = 0, cached_pages = 0;
+    arena_lock(a);
+    for (int rank = 1; rank <= a->max_rank; rank++) {
+        out->free_blocks[rank] = a->free_counts[rank];
+        free_pages += (long)a->free_counts[rank] << (rank - 1);
+#ifdef BUDDY_LAZY
+        cached_pages += (long)a->lazy_counts[rank] << (rank - 1);
+#endif
+    }
+    out->largest_free_rank = a->free_mask ? 31 - __builtin_clz(a->free_mask) : 0;
+    out->splits = a->splits;
+    out->merges = a->merges;
+    out->cold_bytes = a->cold_pages * page_size;
+    arena_unlock(a);
+#ifdef BUDDY_THREAD_SAFE
+    cached_pages += __atomic_load_n(&a->pcp_pages, __ATOMIC_RELAXED);
+#ifdef BUDDY_DEFERRED_FREE
+    cached_pages += __atomic_load_n(&a->deferred_pages, __ATOMIC_RELAXED);
+#endif
+#endif
+    out->enospc = __atomic_load_n(&a->enospc, __ATOMIC_RELAXED);
+
+    out->free_bytes = free_pages * page_size;
+    out->cached_bytes = cached_pages * page_size;
+    out->allocated_bytes = ((size_t)a->total_pages - free_pages - cached_pages) * page_size;
+    if (free_pages > 0) {
+        long largest = 1L << (out->largest_free_rank - 1);
+        out->fragmentation = 1.0 - (double)largest / free_pages;
+    }
+    return OK;
+}
+
+// Whole-pool sweeps over the page metadata. Interior pages are 0, free
+// heads have the high bit set and every other non-zero byte heads an
+// allocated block, so one pass of byte compares classifies the pool
+// SCAN_WIDTH pages at a time: a compare per rank with free blocks counts
+// free heads, and a mask of allocated heads gives the gaps between them,
+// which are exactly the runs of free pages. Without SSE2, AVX2 or NEON the
+// sweep falls back to a byte at a time.
+#if defined(__AVX2__)
+#define SCAN_WIDTH 32
+typedef __m256i scan_vec_t;
+#define scan_load(p) _mm256_loadu_si256((const __m256i *)(p))
+
+// Helper function to get a bit mask of the bytes of v equal to x
+static inline uint32_t scan_eq(scan_vec_t v, uint8_t x) {
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)x)));
+}
+
+// Helper function to get a bit mask of the allocated block heads in v
+static inline uint32_t scan_alloc(scan_vec_t v) {
+    uint32_t zero = scan_eq(v, 0);
+    uint32_t free_heads = _mm256_movemask_epi8(v);   // META_FREE is the sign bit
+    return ~(zero | free_heads);
+}
+#elif defined(__SSE2__)
+#define SCAN_WIDTH 16
+typedef __m128i scan_vec_t;
+#define scan_load(p) _mm_loadu_si128((const __m128i *)(p))
+
+static inline uint32_t scan_eq(scan_vec_t v, uint8_t x) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)x)));
+}
+
+static inline uint32_t scan_alloc(scan_vec_t v) {
+    uint32_t zero = scan_eq(v, 0);
+    uint32_t free_heads = _mm_movemask_epi8(v);
+    return ~(zero | free_heads) & 0xffff;
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define SCAN_WIDTH 16
+typedef uint8x16_t scan_vec_t;
+#define scan_load(p) vld1q_u8(p)
+
+// NEON has no movemask; weight each lane by its bit and add the halves
+static inline uint32_t scan_movemask(uint8x16_t lanes) {
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t bits = vandq_u8(lanes, vld1q_u8(weights));
+    return vaddv_u8(vget_low_u8(bits)) | ((uint32_t)vaddv_u8(vget_high_u8(bits)) << 8);
+}
+
+static inline uint32_t scan_eq(scan_vec_t v, uint8_t x) {
+    return scan_movemask(vceqq_u8(v, vdupq_n_u8(x)));
+}
+
+static inline uint32_t scan_alloc(scan_vec_t v) {
+    uint8x16_t head = vtstq_u8(v, v);
+    uint8x16_t free_heads = vtstq_u8(v, vdupq_n_u8(META_FREE));
+    return scan_movemask(vbicq_u8(head, free_heads));
+}
+#endif
+
+// Helper to account for the allocated block heading page_idx
+static void scan_alloc_head(struct buddy_arena *a, buddy_scan_t *out, int page_idx,
+                            int *free_start) {
+    int run = page_idx - *free_start;
+    if (run > out->largest_free_run) {
+        out->largest_free_run = run;
+    }
+    int block_size = 1 << (head_rank(a, page_idx, load_meta(a, page_idx)) - 1);
+    out->allocated_pages += block_size;
+    *free_start = page_idx + block_size;
+}
+
+int buddy_arena_scan(buddy_arena_t *a, buddy_scan_t *out) {
+    if (out == NULL) {
+        return -EINVAL;
+    }
+
+#ifdef BUDDY_THREAD_SAFE
+    pcp_drain_all(a);
+#endif
+
+    arena_lock(a);
+#ifdef BUDDY_LAZY
+    lazy_flush_all(a);
+#endif
+    memset(out, 0, sizeof(*out));
+
+    // Only ranks that have free blocks need a compare. In BUDDY_THREAD_SAFE
+    // builds a concurrent per-CPU cache hit may flip an allocated head
+    // between its plain and cached form under the sweep; both read as
+    // allocated, so the report is unaffected.
+    const page_meta_t *meta = a->page_metadata;
+    int free_start = 0;
+    int page_idx = 0;
+#ifdef SCAN_WIDTH
+    int free_ranks[RANK_LIMIT];
+    int nranks = 0;
+    for (unsigned int mask = a->free_mask; mask != 0; mask &= mask - 1) {
+        free_ranks[nranks++] = __builtin_ctz(mask);
+    }
+
+    for (; page_idx + SCAN_WIDTH <= a->total_pages; page_idx += SCAN_WIDTH) {
+        scan_vec_t v = scan_load(meta + page_idx);
+        for (int i = 0; i < nranks; i++) {
+            out->free_blocks[free_ranks[i]] += __builtin_popcount(scan_eq(v, META_FREE | free_ranks[i]));
+        }
+        for (uint32_t heads = scan_alloc(v); heads != 0; heads &= heads - 1) {
+            scan_alloc_head(a, out, page_idx + __builtin_ctz(heads), &free_start);
+        }
+    }
+#endif
+    for (; page_idx < a->total_pages; page_idx++) {
+        page_meta_t m = meta[page_idx];
+        if (m & META_FREE) {
+            out->free_blocks[meta_rank(m)]++;
+        } else if (m != 0) {
+            scan_alloc_head(a, out, page_idx, &free_start);
+        }
+    }
+    arena_unlock(a);
+
+    int run = a->total_pages - free_start;
+    if (run > out->largest_free_run) {
+        out->largest_free_run = run;
+    }
+    for (int rank = 1; rank <= RANK_LIMIT; rank++) {
+        out->free_pages += (long)out->free_blocks[rank] << (rank - 1);
+    }
+    return OK;
+}
+
+int init_page(void *p, int pgcount) {
+    if (pgcount < 0) {
+        return -EINVAL;
+    }
+
+    // Reuse the previous metadata buffer when it is large enough
+    size_t size = arrays_size(pgcount);
+    if (size > default_meta_size) {
+        void *meta = aligned_alloc(CACHE_LINE, size);
+        if (meta == NULL) {
+            return -ENOMEM;
+        }
+        free(default_meta);
+        default_meta = meta;
+        default_meta_size = size;
+    }
+
+    arena_layout(&default_arena, default_meta, pgcount);
+    return arena_setup(&default_arena, p, pgcount, 0, DEFAULT_MAX_RANK, DEFAULT_PAGE_SHIFT);
+}
+
+void *alloc_pages(int rank) {
+    return buddy_arena_alloc(&default_arena, rank);
+}
+
+int return_pages(void *p) {
+    return buddy_arena_free(&default_arena, p);
+}
+
+int query_ranks(void *p) {
+    return buddy_arena_query_ranks(&default_arena, p);
+}
+
+int query_page_counts(int rank) {
+    return buddy_arena_query_page_counts(&default_arena, rank);
+}
+
+int alloc_pages_bulk(int rank, int n, void **out) {
+    return buddy_arena_alloc_bulk(&default_arena, rank, n, out);
+}
+
+int return_pages_bulk(void **ptrs, int n) {
+    return buddy_arena_free_bulk(&default_arena, ptrs, n);
+}
+
+int buddy_stats(buddy_stats_t *out) {
+    return buddy_arena_stats(&default_arena, out);
+}
+
+int buddy_trim(int min_rank) {
+    // Granules cannot be smaller than the pages of the mapping
+    size_t granule = (size_t)1 << default_arena.page_shift;
+    size_t os_page = sysconf(_SC_PAGESIZE);
+    return buddy_arena_release(&default_arena, min_rank, granule > os_page ? granule : os_page, 0);
+}
+
+void *realloc_pages(void *p, int new_rank) {
+    return buddy_arena_realloc(&default_arena, p, new_rank);
+}
+
+void *alloc_bytes(size_t n) {
+    return buddy_arena_alloc_bytes(&default_arena, n, BUDDY_TRIM);
+}
+
+int return_bytes(void *p) {
+    return buddy_arena_free(&default_arena, p);
+}
+
+void *alloc_small(size_t n) {
+    return buddy_arena_alloc_small(&default_arena, n);
+}
+
+int return_small(void *p) {
+    return buddy_arena_free_small(&default_arena, p);
 }
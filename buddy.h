@@ -1,8 +1,12 @@
 #ifndef OS_MM_H
 #define OS_MM_H
+
+#include <stddef.h>
+
 #define MAX_ERRNO 4095
 
 #define OK          0
+#define ENOMEM      12  /* Out of memory for allocator metadata */
 #define EINVAL      22  /* Invalid argument */    
 #define ENOSPC      28  /* No page left */  
 
@@ -19,4 +23,242 @@ int return_pages(void *p);
 int query_ranks(void *p);
 int query_page_counts(int rank);
 
+/*
+ * Batch variants. alloc_pages_bulk stores up to n blocks of the given rank in
+ * out and returns how many it got (fewer than n once the pool runs dry).
+ * return_pages_bulk frees n blocks and coalesces runs of adjacent blocks,
+ * best when ptrs is sorted by address; it returns -EINVAL if any pointer was
+ * illegal, after freeing all the legal ones.
+ */
+int alloc_pages_bulk(int rank, int n, void **out);
+int return_pages_bulk(void **ptrs, int n);
+
+/*
+ * Resize a block allocated by alloc_pages to new_rank. Shrinking returns
+ * the upper halves to the pool; growing absorbs the free buddies above a
+ * block that is their lower half. Both keep p. Otherwise the contents move
+ * to a new block and p is freed. Returns the (possibly new) address, or an
+ * error pointer with p left untouched.
+ */
+void *realloc_pages(void *p, int new_rank);
+
+/*
+ * Byte-sized allocation. alloc_bytes picks the smallest rank that covers n
+ * bytes and trims the unused tail of the block back to the free lists, so a
+ * 20K request holds five pages rather than eight. return_bytes releases
+ * the whole allocation (return_pages accepts it too).
+ */
+void *alloc_bytes(size_t n);
+int return_bytes(void *p);
+
+/*
+ * Small objects up to 2048 bytes, from slabs of cache-line multiple size
+ * classes (64, 128, ... 512, 768, 1024, 1536, 2048). Objects are cache-line
+ * aligned when the pool is, and alloc and free take an object off or put
+ * it back on its slab without splitting or merging any block. A slab goes
+ * back to the pool once all its objects are free. return_small returns
+ * -EINVAL for pointers that are not live objects, double frees included.
+ * Slab pages are not blocks: return_pages, realloc_pages and query_ranks
+ * refuse them with -EINVAL.
+ */
+void *alloc_small(size_t n);
+int return_small(void *p);
+
+/*
+ * Independent buddy arenas. Each arena manages its own region with its own
+ * free lists and metadata; the five functions above are wrappers over a
+ * default arena that init_page (re)initializes.
+ *
+ * Build with -DBUDDY_THREAD_SAFE -pthread to make the alloc/free/query calls
+ * safe to use concurrently on the same arena. init_page, buddy_arena_init*
+ * and buddy_arena_destroy must not race with other calls on that arena.
+ */
+typedef struct buddy_arena buddy_arena_t;
+
+buddy_arena_t *buddy_arena_init(void *p, int pgcount);
+
+/*
+ * Initialize an arena whose header and per-page metadata live in a
+ * caller-supplied buffer of at least buddy_arena_meta_size(pgcount) bytes.
+ * With meta == NULL the metadata is carved out of the head of the pool,
+ * and the arena manages the pages that follow it.
+ */
+size_t buddy_arena_meta_size(int pgcount);
+buddy_arena_t *buddy_arena_init_meta(void *p, int pgcount, void *meta, size_t meta_size);
+
+/*
+ * Fully configurable initialization; the functions above are shorthands.
+ * cfg may be NULL for the defaults. With neither a meta buffer nor
+ * BUDDY_ARENA_META_IN_POOL, the metadata is heap-allocated.
+ *
+ * BUDDY_ARENA_ALIGN_NATURAL aligns blocks on their size in the address
+ * space rather than relative to p (which must then be page aligned), so
+ * large blocks line up with huge pages even when p does not; the pages
+ * before the first aligned boundary become smaller blocks.
+ */
+#define BUDDY_ARENA_ALIGN_NATURAL 0x1
+#define BUDDY_ARENA_META_IN_POOL  0x2  /* Carve the metadata from the pool head */
+
+#define BUDDY_RANK_LIMIT 31  /* Largest supported max_rank */
+
+typedef struct {
+    unsigned int flags;
+    void *meta;         /* Caller metadata buffer, or NULL */
+    size_t meta_size;
+    int max_rank;       /* Largest rank, 1..BUDDY_RANK_LIMIT; 0 for 16 */
+    int page_shift;     /* log2 of the page size, 6..30; 0 for 4 KiB pages */
+} buddy_arena_config_t;
+
+buddy_arena_t *buddy_arena_init_config(void *p, int pgcount, const buddy_arena_config_t *cfg);
+
+/*
+ * Attach to an arena set up earlier, possibly by another process, whose
+ * metadata lives in the pool (BUDDY_ARENA_META_IN_POOL) or in a caller
+ * buffer that outlived its creator, such as shared memory. Pass the same
+ * pgcount and cfg as at init; p and the buffer may be mapped at different
+ * addresses, but with BUDDY_ARENA_ALIGN_NATURAL p must keep its alignment.
+ * Every allocation survives, with no replay: the metadata stores page
+ * indices only, so attaching just re-points the header at the current
+ * mappings. Blocks cached by the previous owner's threads are freed. The
+ * arena must have been left between calls and must not be in use by
+ * anybody else. Returns -EINVAL if no matching arena is found, including
+ * one set up by a build with other BUDDY_* options.
+ */
+buddy_arena_t *buddy_arena_attach(void *p, int pgcount, const buddy_arena_config_t *cfg);
+void buddy_arena_destroy(buddy_arena_t *arena);
+buddy_arena_t *buddy_default_arena(void);
+void *buddy_arena_alloc(buddy_arena_t *arena, int rank);
+int buddy_arena_free(buddy_arena_t *arena, void *p);
+int buddy_arena_query_ranks(buddy_arena_t *arena, void *p);
+int buddy_arena_query_page_counts(buddy_arena_t *arena, int rank);
+int buddy_arena_alloc_bulk(buddy_arena_t *arena, int rank, int n, void **out);
+int buddy_arena_free_bulk(buddy_arena_t *arena, void **ptrs, int n);
+
+#define BUDDY_TRIM 0x1  /* Give the unused tail of the block back */
+void *buddy_arena_alloc_bytes(buddy_arena_t *arena, size_t n, int flags);
+void *buddy_arena_realloc(buddy_arena_t *arena, void *p, int new_rank);
+void *buddy_arena_alloc_small(buddy_arena_t *arena, size_t n);
+int buddy_arena_free_small(buddy_arena_t *arena, void *p);
+
+/*
+ * Return the physical backing of free blocks of min_rank or larger to the
+ * OS with madvise, in whole granules (the mapping's page size: 4 KiB, or
+ * the huge page size for huge-page pools). The pool must be an anonymous
+ * or hugetlb mapping. With BUDDY_RELEASE_LAZY the kernel reclaims the
+ * granules only under pressure (MADV_FREE; not for hugetlb). Returns the
+ * number of pages released.
+ *
+ * Released pages stay cold, costing no memory, until their block is
+ * handed out again: the allocator itself does not touch them, so calling
+ * this again skips them and allocating them faults them in only as the
+ * owner writes. buddy_trim does this for the default arena with the OS
+ * page size as the granule.
+ */
+#define BUDDY_RELEASE_LAZY 0x1
+int buddy_arena_release(buddy_arena_t *arena, int min_rank, size_t granule, int flags);
+int buddy_trim(int min_rank);
+
+/*
+ * Checked frees. In builds with -DBUDDY_CHECKED every block comes with a
+ * tag from buddy_arena_alloc_tagged, and buddy_arena_free_tagged returns
+ * -EINVAL when the tag is stale, i.e. the block was freed (and maybe
+ * reallocated with another size) since. Frees also verify the head's
+ * alignment. Without BUDDY_CHECKED the tag is always 0 and not checked.
+ *
+ * buddy_arena_check walks the whole pool in any build and returns the
+ * number of inconsistencies between metadata, free lists and the buddy
+ * invariants; 0 means the arena is sound.
+ */
+void *buddy_arena_alloc_tagged(buddy_arena_t *arena, int rank, unsigned int *tag);
+int buddy_arena_free_tagged(buddy_arena_t *arena, void *p, unsigned int tag);
+int buddy_arena_check(buddy_arena_t *arena);
+
+/*
+ * Usage and fragmentation statistics of an arena, cheap enough to poll
+ * often: it copies counters and never walks the free lists. Cached bytes
+ * are freed blocks parked in the per-CPU caches or lazy lists, which the
+ * arena hands out again or coalesces on demand. The fragmentation index
+ * is 1 - (largest free block / free bytes), 0 when nothing is free.
+ */
+typedef struct {
+    int free_blocks[BUDDY_RANK_LIMIT + 1];  /* Indexed by rank */
+    size_t free_bytes;
+    size_t cached_bytes;
+    size_t allocated_bytes;
+    int largest_free_rank;                  /* 0 when nothing is free */
+    double fragmentation;
+    unsigned long splits;                   /* Blocks halved to serve allocations */
+    unsigned long merges;                   /* Buddy pairs coalesced on free */
+    unsigned long enospc;                   /* Allocations that failed for lack of space */
+    size_t cold_bytes;                      /* Free bytes released and not touched since */
+} buddy_stats_t;
+
+int buddy_arena_stats(buddy_arena_t *arena, buddy_stats_t *out);
+int buddy_stats(buddy_stats_t *out);    /* Default arena */
+
+/*
+ * Tracepoints, recorded only in builds with -DBUDDY_TRACE (otherwise there
+ * are no rings and buddy_trace_read always returns 0). Each thread records
+ * into a ring of its own of the last BUDDY_TRACE_RING events (4096 by
+ * default); buddy_trace_read moves up to max of the calling thread's
+ * events into out, oldest first, and returns how many it moved.
+ *
+ * Rings are registered on their thread's first event, so a dumper thread
+ * can walk them all: buddy_trace_rings returns how many there are and
+ * buddy_trace_read_ring(i, ...) drains ring i like buddy_trace_read, while
+ * its thread keeps recording. A ring outlives its thread until another one
+ * takes it over, so the last events of exited threads can still be read.
+ * At most BUDDY_TRACE_MAX_THREADS (256) rings exist; threads beyond that
+ * record nothing.
+ *
+ *   event                   rank            arg0                arg1
+ *   BUDDY_TRACE_ALLOC_ENTER requested       -                   -
+ *   BUDDY_TRACE_ALLOC_EXIT  requested       rank served from    page index or -errno
+ *   BUDDY_TRACE_SPLIT       split block     split depth         page index
+ *   BUDDY_TRACE_MERGE       merged block    merge depth         page index
+ *   BUDDY_TRACE_LIST_HEAD   free list       new head page       old head page
+ *
+ * Page indices are relative to the arena, -1 for an empty list. A rank
+ * served from of 0 means the allocation failed.
+ *
+ * Which events fire depends on the engine. ALLOC_ENTER and ALLOC_EXIT
+ * bracket alloc_pages and buddy_arena_alloc in every build, and SPLIT and
+ * MERGE come from every engine whenever the core splits or coalesces;
+ * with BUDDY_LAZY or the per-CPU caches a free merges only once its block
+ * is flushed. LIST_HEAD comes only from the default LIFO free lists:
+ * BUDDY_ADDRESS_ORDERED and BUDDY_BITMAP_TREE keep free blocks in bitmaps,
+ * which have no list heads, and never emit it.
+ */
+#define BUDDY_TRACE_ALLOC_ENTER 1
+#define BUDDY_TRACE_ALLOC_EXIT  2
+#define BUDDY_TRACE_SPLIT       3
+#define BUDDY_TRACE_MERGE       4
+#define BUDDY_TRACE_LIST_HEAD   5
+
+typedef struct {
+    unsigned long long ns;  /* CLOCK_MONOTONIC */
+    int event;
+    int rank;
+    int arg0;
+    int arg1;
+} buddy_trace_event_t;
+
+int buddy_trace_read(buddy_trace_event_t *out, int max);
+int buddy_trace_rings(void);
+int buddy_trace_read_ring(int ring, buddy_trace_event_t *out, int max);
+
+/*
+ * Pool health report from one vectorized sweep over the page metadata:
+ * free blocks per rank, free and allocated pages, and the longest run of
+ * adjacent free pages, which may span several free blocks.
+ */
+typedef struct {
+    int free_blocks[BUDDY_RANK_LIMIT + 1];  /* Indexed by rank */
+    long free_pages;
+    long allocated_pages;
+    int largest_free_run;                   /* In pages */
+} buddy_scan_t;
+
+int buddy_arena_scan(buddy_arena_t *arena, buddy_scan_t *out);
+
 #endif
\ No newline at end of file
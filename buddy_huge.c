@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "buddy_huge.h"
+
+#define PAGE_SHIFT 12
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+// Helper function to map size bytes aligned to 1 << huge_shift, from
+// hugetlbfs if possible and as THP-eligible anonymous memory otherwise
+static void *map_huge(size_t size, int huge_shift, int *hugetlb) {
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (huge_shift << MAP_HUGE_SHIFT),
+                      -1, 0);
+    if (base != MAP_FAILED) {
+        *hugetlb = 1;
+        return base;
+    }
+
+    // Over-map by one huge page and trim both ends to the alignment
+    size_t huge = (size_t)1 << huge_shift;
+    char *raw = mmap(NULL, size + huge, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char *)(((uintptr_t)raw + huge - 1) & ~(uintptr_t)(huge - 1));
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    if (aligned + size < raw + size + huge) {
+        munmap(aligned + size, raw + size + huge - (aligned + size));
+    }
+    // Without THP support the pool still works with small pages
+    madvise(aligned, size, MADV_HUGEPAGE);
+    *hugetlb = 0;
+    return aligned;
+}
+
+int buddy_huge_init(buddy_huge_pool_t *pool, int pgcount, int huge_shift) {
+    if (pool == NULL || pgcount <= 0 || huge_shift <= PAGE_SHIFT ||
+        huge_shift - PAGE_SHIFT + 1 > BUDDY_RANK_LIMIT) {
+        return -EINVAL;
+    }
+    memset(pool, 0, sizeof(*pool));
+
+    size_t huge = (size_t)1 << huge_shift;
+    size_t size = ((size_t)pgcount << PAGE_SHIFT) + huge - 1;
+    size &= ~(huge - 1);
+    int hugetlb;
+    void *base = map_huge(size, huge_shift, &hugetlb);
+    if (base == NULL) {
+        return -ENOMEM;
+    }
+
+    // The arena must reach at least the huge rank for whole huge pages to merge
+    int huge_rank = huge_shift - PAGE_SHIFT + 1;
+    buddy_arena_config_t cfg = {
+        .flags = BUDDY_ARENA_ALIGN_NATURAL,
+        .max_rank = huge_rank > 16 ? huge_rank : 16,
+    };
+    buddy_arena_t *arena = buddy_arena_init_config(base, pgcount, &cfg);
+    if (IS_ERR(arena)) {
+        munmap(base, size);
+        return PTR_ERR(arena);
+    }
+
+    pool->arena = arena;
+    pool->base = base;
+    pool->size = size;
+    pool->huge_shift = huge_shift;
+    pool->hugetlb = hugetlb;
+    return OK;
+}
+
+void buddy_huge_destroy(buddy_huge_pool_t *pool) {
+    if (pool == NULL || pool->arena == NULL) {
+        return;
+    }
+    buddy_arena_destroy(pool->arena);
+    munmap(pool->base, pool->size);
+    memset(pool, 0, sizeof(*pool));
+}
+
+int buddy_huge_release(buddy_huge_pool_t *pool, int flags) {
+    if (pool == NULL || pool->arena == NULL) {
+        return -EINVAL;
+    }
+    // A freed hugetlb page is only returned to the reserve, never lazily
+    if (pool->hugetlb) {
+        flags &= ~BUDDY_RELEASE_LAZY;
+    }
+    return buddy_arena_release(pool->arena, pool->huge_shift - PAGE_SHIFT + 1,
+                               (size_t)1 << pool->huge_shift, flags);
+}
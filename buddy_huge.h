@@ -0,0 +1,35 @@
+#ifndef BUDDY_HUGE_H
+#define BUDDY_HUGE_H
+
+#include "buddy.h"
+
+/*
+ * Huge-page backed pools. The pool is mapped aligned to the huge page size
+ * (2 MiB with huge_shift 21, 1 GiB with 30) and the arena is naturally
+ * aligned, so every block of huge_shift - 11 ranks or more (rank 10 for
+ * 2 MiB, rank 19 for 1 GiB) covers whole huge pages. The mapping comes
+ * from hugetlbfs when the kernel has huge pages reserved, and is otherwise
+ * an anonymous mapping marked MADV_HUGEPAGE for transparent huge pages.
+ *
+ * Link buddy_huge.c next to buddy.c. The arena metadata lives on the heap
+ * so that the head of the pool can be released like the rest of it.
+ */
+typedef struct {
+    buddy_arena_t *arena;
+    void *base;
+    size_t size;            /* Mapped bytes, a multiple of the huge page size */
+    int huge_shift;
+    int hugetlb;            /* 1 if backed by hugetlbfs, 0 for THP */
+} buddy_huge_pool_t;
+
+int buddy_huge_init(buddy_huge_pool_t *pool, int pgcount, int huge_shift);
+void buddy_huge_destroy(buddy_huge_pool_t *pool);
+
+/*
+ * Give the huge pages under fully free blocks back to the OS, for instance
+ * when a memory pressure notification arrives. BUDDY_RELEASE_LAZY defers the
+ * reclaim to the kernel (THP only). Returns the number of 4 KiB pages released.
+ */
+int buddy_huge_release(buddy_huge_pool_t *pool, int flags);
+
+#endif
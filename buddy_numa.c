@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "buddy_numa.h"
+
+#define PAGE_SIZE 4096
+#define MPOL_BIND 2
+#define LONG_BITS (8 * sizeof(unsigned long))
+
+// Per-node arenas. The metadata of each arena is carved from the head of
+// its own mapping, so it is node-local as well.
+typedef struct {
+    buddy_arena_t *arena;
+    char *base;
+    size_t size;
+} numa_node_t;
+
+static numa_node_t numa_nodes[BUDDY_NUMA_MAX_NODES];
+static int numa_count = 0;
+static buddy_numa_config_t numa_cfg;
+
+// Helper function to count the online nodes, 1 if that cannot be read
+static int online_nodes(void) {
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (f == NULL) {
+        return 1;
+    }
+    // A list of ranges such as "0-1" or "0,2-3"; the last number is the highest node
+    char line[256];
+    int highest = 0;
+    if (fgets(line, sizeof(line), f) != NULL) {
+        for (char *c = line; *c; c++) {
+            if (*c >= '0' && *c <= '9' && (c == line || c[-1] < '0' || c[-1] > '9')) {
+                highest = atoi(c);
+            }
+        }
+    }
+    fclose(f);
+    return highest + 1 < BUDDY_NUMA_MAX_NODES ? highest + 1 : BUDDY_NUMA_MAX_NODES;
+}
+
+// Helper function to get the node of the calling CPU
+static int current_node(void) {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return 0;
+    }
+    return node % numa_count;
+}
+
+// Map a region for a node and bind it there before anything touches it
+static char *map_node(int node, size_t size) {
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    // Without mbind (no NUMA kernel, seccomp) first touch decides placement
+    unsigned long mask[BUDDY_NUMA_MAX_NODES / LONG_BITS + 1] = {0};
+    mask[node / LONG_BITS] = 1UL << (node % LONG_BITS);
+    syscall(SYS_mbind, base, size, MPOL_BIND, mask, BUDDY_NUMA_MAX_NODES + 1, 0);
+    return base;
+}
+
+int buddy_numa_init(const buddy_numa_config_t *cfg) {
+    if (cfg == NULL || cfg->nodes < 0 || cfg->nodes > BUDDY_NUMA_MAX_NODES ||
+        cfg->pages_per_node <= 0 || cfg->steal_reserve < 0 ||
+        cfg->steal_max_rank < 0 || cfg->steal_max_rank > BUDDY_RANK_LIMIT) {
+        return -EINVAL;
+    }
+    buddy_numa_destroy();
+
+    numa_cfg = *cfg;
+    int count = cfg->nodes ? cfg->nodes : online_nodes();
+    size_t size = (size_t)cfg->pages_per_node * PAGE_SIZE;
+    for (int node = 0; node < count; node++) {
+        char *base = map_node(node, size);
+        if (base == NULL) {
+            buddy_numa_destroy();
+            return -ENOMEM;
+        }
+        buddy_arena_config_t arena_cfg = {
+            .flags = BUDDY_ARENA_META_IN_POOL | BUDDY_ARENA_ALIGN_NATURAL,
+        };
+        buddy_arena_t *arena = buddy_arena_init_config(base, cfg->pages_per_node, &arena_cfg);
+        if (IS_ERR(arena)) {
+            munmap(base, size);
+            buddy_numa_destroy();
+            return PTR_ERR(arena);
+        }
+        numa_nodes[node].arena = arena;
+        numa_nodes[node].base = base;
+        numa_nodes[node].size = size;
+        numa_count = node + 1;
+    }
+    return OK;
+}
+
+void buddy_numa_destroy(void) {
+    for (int node = 0; node < numa_count; node++) {
+        buddy_arena_destroy(numa_nodes[node].arena);
+        munmap(numa_nodes[node].base, numa_nodes[node].size);
+    }
+    memset(numa_nodes, 0, sizeof(numa_nodes));
+    numa_count = 0;
+}
+
+// Helper function to check whether a remote node may give up a block
+static int may_steal(int node, int rank) {
+    if (numa_cfg.steal_max_rank && rank > numa_cfg.steal_max_rank) {
+        return 0;
+    }
+    buddy_stats_t stats;
+    buddy_arena_stats(numa_nodes[node].arena, &stats);
+    long free_pages = (long)(stats.free_bytes / PAGE_SIZE);
+    return free_pages - (1L << (rank - 1)) >= numa_cfg.steal_reserve;
+}
+
+void *buddy_numa_alloc(int rank) {
+    if (numa_count == 0) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    int local = current_node();
+    void *p = buddy_arena_alloc(numa_nodes[local].arena, rank);
+    if (PTR_ERR(p) != -ENOSPC) {
+        return p;
+    }
+
+    // Try the other nodes in turn, starting after the local one
+    for (int i = 1; i < numa_count; i++) {
+        int node = (local + i) % numa_count;
+        if (!may_steal(node, rank)) continue;
+        void *q = buddy_arena_alloc(numa_nodes[node].arena, rank);
+        if (!IS_ERR(q)) {
+            return q;
+        }
+    }
+    return p;
+}
+
+int buddy_numa_node_of(void *p) {
+    for (int node = 0; node < numa_count; node++) {
+        if ((char *)p >= numa_nodes[node].base &&
+            (char *)p < numa_nodes[node].base + numa_nodes[node].size) {
+            return node;
+        }
+    }
+    return -EINVAL;
+}
+
+int buddy_numa_free(void *p) {
+    int node = buddy_numa_node_of(p);
+    if (node < 0) {
+        return node;
+    }
+    return buddy_arena_free(numa_nodes[node].arena, p);
+}
+
+buddy_arena_t *buddy_numa_arena(int node) {
+    if (node < 0 || node >= numa_count) {
+        return ERR_PTR(-EINVAL);
+    }
+    return numa_nodes[node].arena;
+}
@@ -0,0 +1,33 @@
+#ifndef BUDDY_NUMA_H
+#define BUDDY_NUMA_H
+
+#include "buddy.h"
+
+/*
+ * NUMA front-end: one buddy arena per memory node, each over its own
+ * mapping bound to that node with mbind (where the kernel refuses, the
+ * pages are placed by first touch instead). Allocations are served from
+ * the calling thread's node and go to other nodes only on -ENOSPC, subject
+ * to the steal thresholds below.
+ *
+ * Link buddy_numa.c next to buddy.c; for concurrent callers build both
+ * with -DBUDDY_THREAD_SAFE -pthread. buddy_numa_init and
+ * buddy_numa_destroy must not race with the other calls.
+ */
+#define BUDDY_NUMA_MAX_NODES 64
+
+typedef struct {
+    int nodes;              /* 0 to use every online node */
+    int pages_per_node;
+    int steal_reserve;      /* Pages a node always keeps for local callers */
+    int steal_max_rank;     /* Larger requests never go remote; 0 for no limit */
+} buddy_numa_config_t;
+
+int buddy_numa_init(const buddy_numa_config_t *cfg);
+void buddy_numa_destroy(void);
+void *buddy_numa_alloc(int rank);
+int buddy_numa_free(void *p);
+int buddy_numa_node_of(void *p);    /* Node owning p, or -EINVAL */
+buddy_arena_t *buddy_numa_arena(int node);
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef BUDDY_TEMPLATE_H
+#define BUDDY_TEMPLATE_H
+
+#include <stdint.h>
+
+#include "buddy.h"
+
+/*
+ * Header-only buddy allocator specialized at compile time for one fixed
+ * geometry. BUDDY_DEFINE(name, page_shift, max_rank, max_pages) defines
+ *
+ *   name_t                                      the arena, all state inline
+ *   int   name_init(name_t *a, void *p, unsigned pgcount)
+ *   void *name_alloc(name_t *a, unsigned rank)
+ *   int   name_free(name_t *a, void *p)
+ *   int   name_query_ranks(name_t *a, void *p)
+ *   int   name_query_page_counts(name_t *a, unsigned rank)
+ *
+ * with the semantics of init_page, alloc_pages and friends: ranks run from
+ * 1 to max_rank, pgcount is at most max_pages, and errors come back as
+ * -EINVAL/-ENOSPC or ERR_PTR of them. The geometry is a constant, so every
+ * shift and mask folds, indices are unsigned and the whole allocator can
+ * be inlined into its caller. The free list links live in the arena rather
+ * than in the pool, which is never read or written, and nothing is
+ * allocated: a name_t can sit in static storage. Calls are not
+ * thread-safe. For example
+ *
+ *   BUDDY_DEFINE(dma, 12, 10, 1024)     // 4 MiB of 4 KiB pages, up to 2 MiB blocks
+ *   static dma_t dma_pool;
+ */
+#define BUDDY_T_NONE UINT32_MAX
+#define BUDDY_T_FREE 0x80
+#define BUDDY_T_RANK_MASK 0x1f
+
+#define BUDDY_DEFINE(name, page_shift, max_rank, max_pages)                                  \
+_Static_assert((page_shift) >= 6 && (page_shift) <= 30, #name ": bad page_shift");          \
+_Static_assert((max_rank) >= 1 && (max_rank) <= BUDDY_RANK_LIMIT, #name ": bad max_rank");  \
+_Static_assert((max_pages) >= 1 && (max_pages) <= INT32_MAX, #name ": bad max_pages");      \
+                                                                                            \
+typedef struct {                                                                            \
+    char *base;                                                                             \
+    uint32_t total_pages;                                                                   \
+    uint32_t free_mask;                      /* Bit r set while rank r has free blocks */   \
+    uint32_t free_lists[(max_rank) + 1];                                                    \
+    uint32_t free_counts[(max_rank) + 1];                                                   \
+    uint32_t next[(max_pages)];              /* Free list links, by page index */           \
+    uint32_t prev[(max_pages)];                                                             \
+    uint8_t meta[(max_pages)];               /* Head pages: rank, | BUDDY_T_FREE if free */ \
+} name##_t;                                                                                 \
+                                                                                            \
+static inline void name##_push(name##_t *a, uint32_t idx, unsigned rank) {                  \
+    uint32_t head = a->free_lists[rank];                                                    \
+    a->next[idx] = head;                                                                    \
+    a->prev[idx] = BUDDY_T_NONE;                                                            \
+    if (head != BUDDY_T_NONE) {                                                             \
+        a->prev[head] = idx;                                                                \
+    }                                                                                       \
+    a->free_lists[rank] = idx;                                                              \
+    a->free_counts[rank]++;                                                                 \
+    a->free_mask |= 1u << rank;                                                             \
+    a->meta[idx] = (uint8_t)(BUDDY_T_FREE | rank);                                          \
+}                                                                                           \
+                                                                                            \
+static inline void name##_unlink(name##_t *a, uint32_t idx, unsigned rank) {                \
+    uint32_t next = a->next[idx], prev = a->prev[idx];                                      \
+    if (prev != BUDDY_T_NONE) {                                                             \
+        a->next[prev] = next;                                                               \
+    } else {                                                                                \
+        a->free_lists[rank] = next;                                                         \
+    }                                                                                       \
+    if (next != BUDDY_T_NONE) {                                                             \
+        a->prev[next] = prev;                                                               \
+    }                                                                                       \
+    if (--a->free_counts[rank] == 0) {                                                      \
+        a->free_mask &= ~(1u << rank);                                                      \
+    }                                                                                       \
+}                                                                                           \
+                                                                                            \
+/* Page index of a block head address, BUDDY_T_NONE if p is not one */                     \
+static inline uint32_t name##_index(name##_t *a, void *p) {                                 \
+    uintptr_t offset = (uintptr_t)p - (uintptr_t)a->base;                                   \
+    if ((offset & ((1u << (page_shift)) - 1)) != 0 ||                                       \
+        (offset >> (page_shift)) >= a->total_pages) {                                       \
+        return BUDDY_T_NONE;                                                                \
+    }                                                                                       \
+    return (uint32_t)(offset >> (page_shift));                                              \
+}                                                                                           \
+                                                                                            \
+static inline int name##_init(name##_t *a, void *p, unsigned pgcount) {                     \
+    if (p == NULL || pgcount > (max_pages)) {                                               \
+        return -EINVAL;                                                                     \
+    }                                                                                       \
+    a->base = (char *)p;                                                                    \
+    a->total_pages = pgcount;                                                               \
+    a->free_mask = 0;                                                                       \
+    for (unsigned r = 0; r <= (max_rank); r++) {                                            \
+        a->free_lists[r] = BUDDY_T_NONE;                                                    \
+        a->free_counts[r] = 0;                                                              \
+    }                                                                                       \
+    for (uint32_t i = 0; i < pgcount; i++) {                                                \
+        a->meta[i] = 0;                                                                     \
+    }                                                                                       \
+    /* Largest blocks first, capped by alignment and by what is left */                     \
+    for (uint32_t idx = 0; idx < pgcount;) {                                                \
+        unsigned rank = 32 - (unsigned)__builtin_clz(pgcount - idx);                        \
+        if (idx != 0 && (unsigned)__builtin_ctz(idx) + 1 < rank) {                          \
+            rank = (unsigned)__builtin_ctz(idx) + 1;                                        \
+        }                                                                                   \
+        if (rank > (max_rank)) {                                                            \
+            rank = (max_rank);                                                              \
+        }                                                                                   \
+        name##_push(a, idx, rank);                                                          \
+        idx += 1u << (rank - 1);                                                            \
+    }                                                                                       \
+    return OK;                                                                              \
+}                                                                                           \
+                                                                                            \
+static inline void *name##_alloc(name##_t *a, unsigned rank) {                              \
+    if (rank - 1 >= (max_rank)) {                                                           \
+        return ERR_PTR(-EINVAL);                                                            \
+    }                                                                                       \
+    uint32_t candidates = a->free_mask >> rank;                                             \
+    if (candidates == 0) {                                                                  \
+        return ERR_PTR(-ENOSPC);                                                            \
+    }                                                                                       \
+    unsigned current = rank + (unsigned)__builtin_ctz(candidates);                          \
+    uint32_t idx = a->free_lists[current];                                                  \
+    name##_unlink(a, idx, current);                                                         \
+    /* Hand the upper halves back until the block has the requested rank */                 \
+    while (current > rank) {                                                                \
+        current--;                                                                          \
+        name##_push(a, idx + (1u << (current - 1)), current);                               \
+    }                                                                                       \
+    a->meta[idx] = (uint8_t)rank;                                                           \
+    return a->base + ((size_t)idx << (page_shift));                                         \
+}                                                                                           \
+                                                                                            \
+static inline int name##_free(name##_t *a, void *p) {                                       \
+    uint32_t idx = name##_index(a, p);                                                      \
+    if (idx == BUDDY_T_NONE) {                                                              \
+        return -EINVAL;                                                                     \
+    }                                                                                       \
+    unsigned rank = a->meta[idx];                                                           \
+    if (rank == 0 || (rank & BUDDY_T_FREE)) {                                               \
+        return -EINVAL;                                                                     \
+    }                                                                                       \
+    a->meta[idx] = 0;                                                                       \
+    while (rank < (max_rank)) {                                                             \
+        uint32_t buddy = idx ^ (1u << (rank - 1));                                          \
+        if (buddy >= a->total_pages || a->meta[buddy] != (BUDDY_T_FREE | rank)) break;     \
+        name##_unlink(a, buddy, rank);                                                      \
+        a->meta[buddy] = 0;                                                                 \
+        idx &= ~(1u << (rank - 1));                                                         \
+        rank++;                                                                             \
+    }                                                                                       \
+    name##_push(a, idx, rank);                                                              \
+    return OK;                                                                              \
+}                                                                                           \
+                                                                                            \
+static inline int name##_query_ranks(name##_t *a, void *p) {                                \
+    uint32_t idx = name##_index(a, p);                                                      \
+    if (idx == BUDDY_T_NONE) {                                                              \
+        return -EINVAL;                                                                     \
+    }                                                                                       \
+    /* Interior pages are 0; clearing low bits reaches the head */                          \
+    while (idx != 0 && a->meta[idx] == 0) {                                                 \
+        idx &= idx - 1;                                                                     \
+    }                                                                                       \
+    return a->meta[idx] & BUDDY_T_RANK_MASK;                                                \
+}                                                                                           \
+                                                                                            \
+static inline int name##_query_page_counts(name##_t *a, unsigned rank) {                    \
+    if (rank - 1 >= (max_rank)) {                                                           \
+        return -EINVAL;                                                                     \
+    }                                                                                       \
+    return (int)a->free_counts[rank];                                                       \
+}
+
+#endif
@@ -0,0 +1,1596 @@
+// Randomized stress and differential test of the page allocator.
+//
+// Every call is mirrored on a reference model: a naive buddy system that
+// does not pick blocks itself but carves out whatever block the allocator
+// returned. The model checks that the block was free, aligned and of the
+// right rank, and the allocator's free block counts must match the model's
+// after every operation (or every -c operations, so that per-CPU caches and
+// lazy lists are not drained all the time), as must buddy_arena_check.
+// Whichever engine the allocator is built with, the fully coalesced pool
+// must look the same as the model's.
+//
+// The ops cover the whole API: single, tagged, bulk and byte-sized
+// allocations (trimmed runs included), realloc, small objects, release,
+// scans and statistics, and double frees. They run on several pools at
+// once, each with a model of its own:
+//
+//   default    init_page and the page API, -p pages
+//   shared     metadata in the pool, moved with mremap and re-attached
+//   huge       buddy_huge_init, naturally aligned on 2 MiB huge pages
+//   numa0/1    two buddy_numa nodes, allocations through buddy_numa_alloc
+//   template   a buddy_template.h instance, page ops only
+//
+// Held blocks are stamped with their slot, so a block handed out twice or
+// moved without its contents shows up as a clobbered stamp.
+//
+// Traces are either generated from a seed or replayed from a binary log
+// (-r), and any trace can be saved (-w) to replay a failure later. A log is
+// a trace_header_t followed by trace_op_t records; blocks are named by slot
+// numbers rather than addresses, so logs replay on any pool address.
+//
+// With -t, builds with BUDDY_THREAD_SAFE instead run ops spread over that
+// many threads that churn blocks of their own on the default pool; with -H
+// as well, thread 0 only allocates and hands every block to the others,
+// which free it. There is no model then: blocks are stamped while held,
+// and once all threads are done the pool must have coalesced back to what
+// init_page made. `make tsan` runs both under ThreadSanitizer.
+//
+// Builds with BUDDY_TRACE also run a dumper thread that drains the trace
+// rings of every thread while the ops run (see the trace section below);
+// `make check` and `make tsan` run such a build too.
+//
+// Usage: ./stress [-n ops] [-p pages] [-s seed] [-c check_every] [-w file] [-r file]
+//                 [-t threads [-H]]
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "buddy_huge.h"
+#include "buddy_numa.h"
+#include "buddy_template.h"
+
+#define MAXRANK (16)
+#define DEFAULT_PAGES (128 * 1024 / 4)
+#define PAGE (1024 * 4)
+
+#define SHARED_PAGES 4096
+#define HUGE_PAGES 4096
+#define HUGE_SHIFT 21
+#define NUMA_PAGES 4096
+#define TEMPLATE_PAGES 4096
+#define BULK_MAX 16
+
+#define TRACE_MAGIC 0x63727462   // "btrc"
+#define TRACE_VERSION 2
+
+enum {
+    OP_ALLOC = 1, OP_FREE = 2, OP_DOUBLE_FREE = 3, OP_FREE_ALL = 4,
+    OP_ALLOC_TAGGED = 5, OP_ALLOC_BULK = 6, OP_FREE_BULK = 7, OP_ALLOC_BYTES = 8,
+    OP_REALLOC = 9, OP_ALLOC_SMALL = 10, OP_ATTACH = 11, OP_RELEASE = 12,
+    OP_SCAN = 13, OP_STATS = 14,
+};
+
+enum { P_DEFAULT, P_SHARED, P_HUGE, P_NUMA0, P_NUMA1, P_TEMPLATE, POOLS };
+
+// What a slot holds, which decides how it is freed
+enum { K_BLOCK = 1, K_TAGGED, K_RUN, K_SMALL };
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pages;     // Of the default pool; the others have fixed sizes
+    uint32_t slots;
+} trace_header_t;
+
+typedef struct {
+    uint8_t op;
+    uint8_t rank;       // Block rank; trim flag of OP_ALLOC_BYTES, min_rank of OP_RELEASE
+    uint8_t pool;
+    uint8_t arg;        // Bulk count, size code of OP_ALLOC_BYTES/SMALL, OP_RELEASE flags
+    uint32_t slot;
+} trace_op_t;
+
+// A pool and its reference model: one byte per page, rank of a block head
+// with MODEL_FREE for free heads and MODEL_SLAB for slabs, 0 for every
+// other page. off is the logical number of page 0, which blocks are
+// aligned on; it is not 0 for naturally aligned arenas.
+#define MODEL_FREE 0x80
+#define MODEL_SLAB 0x40
+#define MODEL_RANK 0x1f
+
+typedef struct {
+    const char *name;
+    buddy_arena_t *arena;   // NULL for the template pool
+    char *base;
+    int pages;
+    int off;
+    int live;               // 0 if the pool could not be set up here
+    uint8_t *model;
+    int counts[MAXRANK + 1];
+    int *slab_objects;      // Live small objects by slab head page
+    int small_live;
+} pool_t;
+
+typedef struct {
+    void *p;
+    uint8_t pool;
+    uint8_t kind;
+    uint8_t rank;           // For runs, the rank of the block they were cut from
+    int pages;              // Pages of a run
+    unsigned int tag;
+} held_t;
+
+BUDDY_DEFINE(tmpl, 12, MAXRANK, TEMPLATE_PAGES)
+
+static pool_t pools[POOLS];
+static tmpl_t tmpl_arena;
+static buddy_huge_pool_t huge;
+static char *shared_maps[2];    // The shared pool lives in one, the other is reserved
+static int shared_at;
+
+static void *pool;              // The default pool
+static int pages = DEFAULT_PAGES;
+static uint32_t slots;
+static long check_every = 1;
+#if defined(BUDDY_THREAD_SAFE) || defined(BUDDY_TRACE)
+static int threads;             // -t, 0 for the modelled trace
+#endif
+
+// Live blocks by slot, and the block freed last
+static held_t *held;
+static held_t last_freed;
+static unsigned int touched;    // Pools an op went to, checked after it
+
+static long op_index;
+static long failures;
+static long skipped;    // Replayed ops whose slot or pool is in another state here
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void fail(const char *what, long detail) {
+    if (__atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED) < 10) {
+        fprintf(stderr, "op %ld: %s (%ld)\n", op_index, what, detail);
+    }
+}
+
+static void model_put(pool_t *m, int idx, int rank) {
+    m->model[idx] = MODEL_FREE | rank;
+    m->counts[rank]++;
+}
+
+// Same cover of the pool as init_page: largest aligned blocks first
+static void model_init(pool_t *m) {
+    memset(m->model, 0, m->pages);
+    memset(m->counts, 0, sizeof(m->counts));
+    for (int idx = 0; idx < m->pages;) {
+        int logical = idx + m->off;
+        int rank = 32 - __builtin_clz(m->pages - idx);
+        if (logical != 0 && __builtin_ctz(logical) + 1 < rank) {
+            rank = __builtin_ctz(logical) + 1;
+        }
+        if (rank > MAXRANK) {
+            rank = MAXRANK;
+        }
+        model_put(m, idx, rank);
+        idx += 1 << (rank - 1);
+    }
+}
+
+// Head of the block holding a page, -1 if none
+static int model_head(pool_t *m, int idx) {
+    while (idx > 0 && m->model[idx] == 0) {
+        int logical = idx + m->off;
+        idx = (logical & (logical - 1)) - m->off;
+    }
+    return idx < 0 || m->model[idx] == 0 ? -1 : idx;
+}
+
+static int model_aligned(pool_t *m, int idx, int rank) {
+    return ((idx + m->off) & ((1 << (rank - 1)) - 1)) == 0;
+}
+
+// Carve the block the allocator handed out from its free block
+static int model_take(pool_t *m, int idx, int rank) {
+    if (idx < 0 || idx >= m->pages || !model_aligned(m, idx, rank)) {
+        return 0;
+    }
+    int head = model_head(m, idx);
+    if (head < 0) {
+        return 0;
+    }
+    int head_rank = m->model[head] & MODEL_RANK;
+    if (!(m->model[head] & MODEL_FREE) || head_rank < rank || idx >= head + (1 << (head_rank - 1))) {
+        return 0;
+    }
+    m->model[head] = 0;
+    m->counts[head_rank]--;
+    while (head_rank > rank) {
+        head_rank--;
+        int half = 1 << (head_rank - 1);
+        if (idx >= head + half) {
+            model_put(m, head, head_rank);
+            head += half;
+        } else {
+            model_put(m, head + half, head_rank);
+        }
+    }
+    m->model[idx] = rank;
+    return 1;
+}
+
+static void model_give(pool_t *m, int idx, int rank) {
+    m->model[idx] = 0;
+    while (rank < MAXRANK) {
+        int buddy = ((idx + m->off) ^ (1 << (rank - 1))) - m->off;
+        if (buddy < 0 || buddy >= m->pages || m->model[buddy] != (MODEL_FREE | rank)) break;
+        m->model[buddy] = 0;
+        m->counts[rank]--;
+        if (buddy < idx) {
+            idx = buddy;
+        }
+        rank++;
+    }
+    model_put(m, idx, rank);
+}
+
+// Mirror alloc_run's trim of a block of the given rank to pages: the run
+// is cut into pieces largest first and the tail goes back as the largest
+// aligned blocks that fit
+static void model_trim(pool_t *m, int idx, int rank, int pages) {
+    int start = idx;
+    for (int remaining = pages; remaining > 0;) {
+        int piece = 32 - __builtin_clz(remaining);
+        m->model[start] = piece;
+        start += 1 << (piece - 1);
+        remaining -= 1 << (piece - 1);
+    }
+    while (start < idx + (1 << (rank - 1))) {
+        int piece = __builtin_ctz(start - idx) + 1;
+        model_put(m, start, piece);
+        start += 1 << (piece - 1);
+    }
+}
+
+// A trimmed run is freed piece by piece, first to last
+static void model_give_run(pool_t *m, int idx, int pages) {
+    for (int remaining = pages; remaining > 0;) {
+        int piece = 32 - __builtin_clz(remaining);
+        model_give(m, idx, piece);
+        idx += 1 << (piece - 1);
+        remaining -= 1 << (piece - 1);
+    }
+}
+
+static int model_has_space(pool_t *m, int rank) {
+    for (int r = rank; r <= MAXRANK; r++) {
+        if (m->counts[r] > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static long model_free_pages(pool_t *m) {
+    long n = 0;
+    for (int rank = 1; rank <= MAXRANK; rank++) {
+        n += (long)m->counts[rank] << (rank - 1);
+    }
+    return n;
+}
+
+// Longest run of adjacent free pages, across free blocks
+static int model_free_run(pool_t *m) {
+    int best = 0, run = 0;
+    for (int idx = 0; idx < m->pages;) {
+        int size = 1 << ((m->model[idx] & MODEL_RANK) - 1);
+        run = m->model[idx] & MODEL_FREE ? run + size : 0;
+        if (run > best) {
+            best = run;
+        }
+        idx += size;
+    }
+    return best;
+}
+
+static int page_of(pool_t *m, void *p) {
+    long offset = (char *)p - m->base;
+    return offset < 0 || offset >= (long)m->pages * PAGE ? -1 : (int)(offset / PAGE);
+}
+
+static int is_numa(int id) {
+    return id == P_NUMA0 || id == P_NUMA1;
+}
+
+// The calls behind each pool: the page API for the default pool, the
+// buddy_numa front-end for NUMA allocations, the template's own functions,
+// and the arena calls for everything else
+static void *pool_alloc(int id, int rank) {
+    switch (id) {
+    case P_DEFAULT: return alloc_pages(rank);
+    case P_TEMPLATE: return tmpl_alloc(&tmpl_arena, rank);
+    case P_NUMA0: case P_NUMA1: return buddy_numa_alloc(rank);
+    default: return buddy_arena_alloc(pools[id].arena, rank);
+    }
+}
+
+static int pool_free(int id, void *p) {
+    switch (id) {
+    case P_DEFAULT: return return_pages(p);
+    case P_TEMPLATE: return tmpl_free(&tmpl_arena, p);
+    case P_NUMA0: case P_NUMA1: return buddy_numa_free(p);
+    default: return buddy_arena_free(pools[id].arena, p);
+    }
+}
+
+static int pool_query(int id, void *p) {
+    switch (id) {
+    case P_DEFAULT: return query_ranks(p);
+    case P_TEMPLATE: return tmpl_query_ranks(&tmpl_arena, p);
+    default: return buddy_arena_query_ranks(pools[id].arena, p);
+    }
+}
+
+static int pool_counts(int id, int rank) {
+    switch (id) {
+    case P_DEFAULT: return query_page_counts(rank);
+    case P_TEMPLATE: return tmpl_query_page_counts(&tmpl_arena, rank);
+    default: return buddy_arena_query_page_counts(pools[id].arena, rank);
+    }
+}
+
+static void check_pool(int id) {
+    pool_t *m = &pools[id];
+    if (!m->live) return;
+    for (int rank = 1; rank <= MAXRANK; rank++) {
+        int got = pool_counts(id, rank);
+        if (got != m->counts[rank]) {
+            fail("free block counts differ from the model", rank);
+            fprintf(stderr, "    %s pool, rank %d: allocator %d, model %d\n", m->name, rank, got, m->counts[rank]);
+        }
+    }
+    int bad = m->arena != NULL ? buddy_arena_check(m->arena) : 0;
+    if (bad != 0) {
+        fail("buddy_arena_check", bad);
+        fprintf(stderr, "    %s pool\n", m->name);
+    }
+}
+
+#define STAMP(slot) (0x5354414d00000000ull | (slot))
+
+static void hold(uint32_t slot, int id, void *p, int kind, int rank, int run_pages, unsigned int tag) {
+    held[slot] = (held_t){p, id, kind, rank, run_pages, tag};
+    *(uint64_t *)p = STAMP(slot);
+}
+
+// Carve a new block out of the model, checking what query_ranks makes of it
+static int take(int id, void *p, int rank, int query_rank) {
+    pool_t *m = &pools[id];
+    if (!model_take(m, page_of(m, p), rank)) {
+        fail("allocator returned a block that is not free", page_of(m, p));
+        fprintf(stderr, "    %s pool, rank %d\n", m->name, rank);
+        return 0;
+    }
+    int r = pool_query(id, p);
+    if (r != query_rank) {
+        fail("query_ranks of a new block", r);
+    }
+    return 1;
+}
+
+// Whether an allocation of rank may fail: never while the model has a
+// large enough block. buddy_numa_alloc only goes remote where the local
+// node is out of space and the remote one's (uncached) free pages allow it.
+static int out_of_space(const trace_op_t *op, int id, int rank) {
+    if (op->op != OP_ALLOC || !is_numa(id)) {
+        return !model_has_space(&pools[id], rank);
+    }
+    for (int node = P_NUMA0; node <= P_NUMA1; node++) {
+        buddy_stats_t s;
+        buddy_arena_stats(pools[node].arena, &s);
+        if (model_has_space(&pools[node], rank) && s.free_bytes >= (size_t)PAGE << (rank - 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Helper function to get the rank of the slabs serving a small request, as
+// slab_rank does: a header line plus eight objects of the size class
+static int small_rank(size_t n) {
+    size_t size = n <= 512 ? (n + 63) / 64 * 64 : n <= 768 ? 768 : n <= 1024 ? 1024 : n <= 1536 ? 1536 : 2048;
+    int slab_pages = (int)((64 + 8 * size + PAGE - 1) / PAGE);
+    int rank = slab_pages == 1 ? 1 : 33 - __builtin_clz(slab_pages - 1);
+    return rank < MAXRANK ? rank : MAXRANK;
+}
+
+static int slab_head(pool_t *m, void *o, int rank) {
+    int idx = page_of(m, o);
+    return idx < 0 ? -1 : ((idx + m->off) & ~((1 << (rank - 1)) - 1)) - m->off;
+}
+
+#ifdef BUDDY_TRACE
+// With BUDDY_TRACE a dumper thread drains every ring while the ops run and
+// checks what it reads: events well formed and in time order on each
+// ring. Under the model each ALLOC_ENTER must also be followed by its
+// ALLOC_EXIT, and every buddy_arena_alloc behind an op logs what it
+// returned, which the op's ALLOC_EXITs must match in order. Ops wait for
+// the dumper to drain their events before the next one runs, so none is
+// overwritten unread; with -t the rings may overflow and only the form of
+// the events is checked.
+#define TRACE_BATCH 256
+#define TRACE_WINDOW 64     // ALLOC_EXITs of one op, and allocs it logs
+
+typedef struct {
+    int rank;
+    int page;   // Page index in the arena and its model, or -errno
+    int numa;   // buddy_numa_alloc, which may fail on the local node first
+} trace_alloc_t;
+
+typedef struct {
+    unsigned long long ns;  // Of the last event read
+    int pending;            // Rank of an ALLOC_ENTER waiting for its ALLOC_EXIT
+} trace_ring_state_t;
+
+static trace_ring_state_t trace_state[256];     // By ring; buddy.h caps rings at 256
+static trace_alloc_t trace_log[TRACE_WINDOW];   // Written by the ops, read by the dumper
+static int trace_logged;
+static trace_alloc_t trace_exits[TRACE_WINDOW]; // The dumper's own
+static int trace_exited;
+static long trace_events;
+static unsigned long trace_asked, trace_done;
+static int trace_quit;
+static pthread_t trace_dumper;
+
+// Log an alloc of an op that went through buddy_arena_alloc; failures
+// other than -ENOSPC are refused before any event
+static void trace_alloc(int id, void *p, int rank, int numa) {
+    if (id == P_TEMPLATE || PTR_ERR(p) == -EINVAL) return;
+    if (!IS_ERR(p) && numa) {
+        id = P_NUMA0 + buddy_numa_node_of(p);
+    }
+    pool_t *m = &pools[id];
+    if (trace_logged == TRACE_WINDOW) {
+        fail("too many allocs in one op", trace_logged);
+        return;
+    }
+    trace_log[trace_logged++] = (trace_alloc_t){rank, IS_ERR(p) ? (int)PTR_ERR(p) : page_of(m, p), numa};
+}
+
+static void trace_check(trace_ring_state_t *st, const buddy_trace_event_t *e, int n) {
+    for (int i = 0; i < n; i++, e++) {
+        trace_events++;
+        if (e->ns < st->ns) {
+            fail("trace events out of order", e->event);
+        }
+        st->ns = e->ns;
+        if (e->rank < 1 || e->rank > MAXRANK) {
+            fail("trace event of a bad rank", e->rank);
+            continue;
+        }
+        switch (e->event) {
+        case BUDDY_TRACE_ALLOC_ENTER:
+            if (threads == 0 && st->pending) {
+                fail("ALLOC_ENTER without an ALLOC_EXIT", st->pending);
+            }
+            st->pending = e->rank;
+            break;
+        case BUDDY_TRACE_ALLOC_EXIT:
+            if (threads == 0 && st->pending != e->rank) {
+                fail("ALLOC_EXIT without its ALLOC_ENTER", e->rank);
+            }
+            st->pending = 0;
+            if (e->arg1 < 0 ? e->arg0 != 0 || e->arg1 != -ENOSPC : e->arg0 < e->rank || e->arg0 > MAXRANK) {
+                fail("ALLOC_EXIT of a bad result", e->arg1);
+            }
+            if (threads == 0 && trace_exited == TRACE_WINDOW) {
+                fail("too many ALLOC_EXITs in one op", trace_exited);
+            } else if (threads == 0) {
+                trace_exits[trace_exited++] = (trace_alloc_t){e->rank, e->arg1, 0};
+            }
+            break;
+        case BUDDY_TRACE_SPLIT:
+        case BUDDY_TRACE_MERGE:
+            if (e->arg0 < 1 || e->arg0 >= e->rank || e->arg1 < 0) {
+                fail("split or merge of a bad depth or page", e->arg0);
+            }
+            break;
+        case BUDDY_TRACE_LIST_HEAD:
+#ifdef BUDDY_ADDRESS_ORDERED
+            fail("LIST_HEAD from a bitmap engine", e->rank);
+#endif
+            if (e->arg0 < -1 || e->arg1 < -1) {
+                fail("LIST_HEAD of a bad page", e->arg0);
+            }
+            break;
+        default: fail("unknown trace event", e->event);
+        }
+    }
+}
+
+// Match the ALLOC_EXITs of an op against the allocs it logged. A NUMA
+// alloc that went remote failed on the local node first, which only shows
+// as an ALLOC_EXIT more than the log has room for.
+static void trace_match(void) {
+    int j = 0;
+    for (int i = 0; i < trace_logged; i++) {
+        const trace_alloc_t *want = &trace_log[i];
+        if (want->numa && trace_exited - j > trace_logged - i &&
+            trace_exits[j].rank == want->rank && trace_exits[j].page == -ENOSPC) {
+            j++;
+        }
+        if (j == trace_exited || trace_exits[j].rank != want->rank || trace_exits[j].page != want->page) {
+            fail("ALLOC_EXIT differs from the alloc", want->page);
+            fprintf(stderr, "    rank %d, %d ALLOC_EXITs for %d allocs\n", want->rank, trace_exited, trace_logged);
+            return;
+        }
+        j++;
+    }
+    if (j != trace_exited) {
+        fail("ALLOC_EXIT of no alloc", trace_exits[j].page);
+    }
+    if (trace_state[0].pending) {
+        fail("ALLOC_ENTER without an ALLOC_EXIT", trace_state[0].pending);
+    }
+}
+
+static int trace_drain(void) {
+    buddy_trace_event_t batch[TRACE_BATCH];
+    int got = 0;
+    for (int ring = 0; ring < buddy_trace_rings(); ring++) {
+        int n;
+        while ((n = buddy_trace_read_ring(ring, batch, TRACE_BATCH)) > 0) {
+            trace_check(&trace_state[ring], batch, n);
+            got += n;
+        }
+        if (n < 0) {
+            fail("buddy_trace_read_ring", n);
+        }
+    }
+    return got;
+}
+
+// Drain while the ops run; an op asks for a drain once it is done and
+// waits until everything it recorded is read
+static void *dumper(void *arg) {
+    (void)arg;
+    for (;;) {
+        int quit = __atomic_load_n(&trace_quit, __ATOMIC_ACQUIRE);
+        unsigned long asked = __atomic_load_n(&trace_asked, __ATOMIC_ACQUIRE);
+        int got = trace_drain();
+        if (asked != trace_done) {
+            trace_match();
+            trace_exited = 0;
+            __atomic_store_n(&trace_done, asked, __ATOMIC_RELEASE);
+        } else if (quit) {
+            break;
+        } else if (got == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void trace_sync(void) {
+    if (threads > 0) return;
+    unsigned long asked = trace_asked + 1;
+    __atomic_store_n(&trace_asked, asked, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&trace_done, __ATOMIC_ACQUIRE) != asked) {
+        sched_yield();
+    }
+    trace_logged = 0;
+}
+
+// Check the set-up's events on the main thread's own ring, then start the
+// dumper on every ring
+static void trace_start(void) {
+    buddy_trace_event_t batch[TRACE_BATCH];
+    int n;
+    while ((n = buddy_trace_read(batch, TRACE_BATCH)) > 0) {
+        trace_check(&trace_state[0], batch, n);
+    }
+    trace_exited = 0;
+    if (buddy_trace_rings() != 1) {
+        fail("rings before any thread ran", buddy_trace_rings());
+    }
+    if (pthread_create(&trace_dumper, NULL, dumper, NULL) != 0) {
+        perror("pthread_create");
+        exit(2);
+    }
+}
+
+// Stop the dumper once it has read the rings of every thread. Rings of
+// exited threads stay readable, and ring numbers past the last are refused.
+static void trace_stop(void) {
+    trace_sync();
+    __atomic_store_n(&trace_quit, 1, __ATOMIC_RELEASE);
+    pthread_join(trace_dumper, NULL);
+    int rings = buddy_trace_rings();
+    buddy_trace_event_t e;
+    if (rings < (threads > 0 ? 2 : 1) || trace_events == 0) {
+        fail("rings or events missing", rings);
+    }
+    if (buddy_trace_read_ring(rings, &e, 1) != -EINVAL || buddy_trace_read_ring(-1, &e, 1) != -EINVAL) {
+        fail("buddy_trace_read_ring of a bad ring", rings);
+    }
+
+    // A last alloc, on the main thread's ring, read by the thread itself
+    void *p = alloc_pages(1);
+    buddy_trace_event_t got[TRACE_BATCH];
+    int n = IS_ERR(p) || return_pages(p) != OK ? 0 : buddy_trace_read(got, TRACE_BATCH);
+    int exit = 1;
+    while (exit < n && got[exit].event != BUDDY_TRACE_ALLOC_EXIT) {
+        exit++;
+    }
+    if (n == 0 || got[0].event != BUDDY_TRACE_ALLOC_ENTER || exit == n ||
+        got[exit].arg1 != page_of(&pools[P_DEFAULT], p)) {
+        fail("buddy_trace_read of the main thread's ring", n);
+    }
+}
+#else
+#define trace_alloc(id, p, rank, numa) ((void)0)
+#define trace_sync() ((void)0)
+#define trace_start() ((void)0)
+#define trace_stop() ((void)0)
+#endif
+
+static void op_alloc(const trace_op_t *op, int id) {
+    uint32_t slot = op->slot;
+    int rank = op->rank;
+    if (rank < 1 || rank > MAXRANK || (op->op == OP_ALLOC_TAGGED && id == P_TEMPLATE)) {
+        fail("bad alloc record", rank);
+        return;
+    }
+    // An engine that places blocks differently may have run out of
+    // space at other points of a recorded trace
+    if (held[slot].p != NULL) {
+        skipped++;
+        return;
+    }
+    unsigned int tag = 0;
+    void *p = op->op == OP_ALLOC_TAGGED ? buddy_arena_alloc_tagged(pools[id].arena, rank, &tag) : pool_alloc(id, rank);
+    trace_alloc(id, p, rank, op->op == OP_ALLOC && is_numa(id));
+    if (IS_ERR(p)) {
+        if (PTR_ERR(p) != -ENOSPC || !out_of_space(op, id, rank)) {
+            fail("alloc failed with space left", PTR_ERR(p));
+        }
+        return;
+    }
+    if (op->op == OP_ALLOC && is_numa(id)) {
+        id = P_NUMA0 + buddy_numa_node_of(p);
+        touched |= 1u << id;
+    }
+    if (take(id, p, rank, rank)) {
+        hold(slot, id, p, op->op == OP_ALLOC_TAGGED ? K_TAGGED : K_BLOCK, rank, 0, tag);
+    }
+}
+
+static int free_held(const held_t *h) {
+    buddy_arena_t *a = pools[h->pool].arena;
+    switch (h->kind) {
+    case K_TAGGED: return buddy_arena_free_tagged(a, h->p, h->tag);
+    case K_RUN: return h->pool == P_DEFAULT ? return_bytes(h->p) : buddy_arena_free(a, h->p);
+    case K_SMALL: return h->pool == P_DEFAULT ? return_small(h->p) : buddy_arena_free_small(a, h->p);
+    default: return pool_free(h->pool, h->p);
+    }
+}
+
+// Give a freed slot's pages back to the model. An emptied slab goes back to
+// the core unless it is the last partial one of its class, which only the
+// allocator knows: query_ranks still refuses a slab it kept.
+static void model_free(const held_t *h) {
+    pool_t *m = &pools[h->pool];
+    int idx = page_of(m, h->p);
+    if (h->kind == K_RUN) {
+        model_give_run(m, idx, h->pages);
+    } else if (h->kind != K_SMALL) {
+        model_give(m, idx, h->rank);
+    } else {
+        int head = slab_head(m, h->p, h->rank);
+        m->small_live--;
+        if (--m->slab_objects[head] == 0 && pool_query(h->pool, m->base + (size_t)head * PAGE) != -EINVAL) {
+            model_give(m, head, h->rank);
+        }
+    }
+}
+
+static void op_free(uint32_t slot) {
+    held_t *h = &held[slot];
+    if (h->p == NULL) {
+        skipped++;
+        return;
+    }
+    touched |= 1u << h->pool;
+    if (*(uint64_t *)h->p != STAMP(slot)) {
+        fail("block clobbered while held", slot);
+    }
+    int r = free_held(h);
+    if (r != OK) {
+        fail("free of a live block", r);
+    }
+    model_free(h);
+    last_freed = *h;
+    h->p = NULL;
+}
+
+static void op_double_free(void) {
+    held_t *h = &last_freed;
+    if (h->p == NULL) return;
+    pool_t *m = &pools[h->pool];
+    touched |= 1u << h->pool;
+    // Only meaningful while the address heads no live block or object
+    if (h->kind == K_SMALL) {
+        if (m->small_live > 0) return;
+    } else {
+        int idx = page_of(m, h->p);
+        if (m->model[idx] != 0 && !(m->model[idx] & MODEL_FREE)) return;
+    }
+    int r = free_held(h);
+    if (r != -EINVAL) {
+        fail("double free accepted", r);
+    }
+}
+
+static void op_alloc_bulk(const trace_op_t *op, int id) {
+    int rank = op->rank;
+    int n = op->arg % BULK_MAX + 1;
+    if (rank < 1 || rank > MAXRANK || id == P_TEMPLATE) {
+        fail("bad alloc_bulk record", rank);
+        return;
+    }
+    // Empty slots from op->slot on
+    uint32_t want[BULK_MAX];
+    int k = 0;
+    for (uint32_t s = op->slot, tries = 0; k < n && tries < 4 * BULK_MAX; s = (s + 1) % slots, tries++) {
+        if (held[s].p == NULL) {
+            want[k++] = s;
+        }
+    }
+    void *out[BULK_MAX];
+    int got = id == P_DEFAULT ? alloc_pages_bulk(rank, k, out) : buddy_arena_alloc_bulk(pools[id].arena, rank, k, out);
+    if (got < 0 || got > k) {
+        fail("alloc_bulk", got);
+        return;
+    }
+    for (int i = 0; i < got; i++) {
+        if (take(id, out[i], rank, rank)) {
+            hold(want[i], id, out[i], K_BLOCK, rank, 0, 0);
+        }
+    }
+    if (got < k && model_has_space(&pools[id], rank)) {
+        fail("alloc_bulk stopped with space left", got);
+    }
+}
+
+static void op_free_bulk(const trace_op_t *op, int id) {
+    int n = op->arg % BULK_MAX + 1;
+    if (id == P_TEMPLATE) {
+        fail("bad free_bulk record", id);
+        return;
+    }
+    // Blocks and runs of the pool from op->slot on
+    uint32_t from[BULK_MAX];
+    void *ptrs[BULK_MAX];
+    int k = 0;
+    for (uint32_t s = op->slot, tries = 0; k < n && tries < 4 * BULK_MAX; s = (s + 1) % slots, tries++) {
+        held_t *h = &held[s];
+        if (h->p != NULL && h->pool == id && (h->kind == K_BLOCK || h->kind == K_RUN)) {
+            if (*(uint64_t *)h->p != STAMP(s)) {
+                fail("block clobbered while held", s);
+            }
+            from[k] = s;
+            ptrs[k++] = h->p;
+        }
+    }
+    if (k == 0) {
+        skipped++;
+        return;
+    }
+    int r = id == P_DEFAULT ? return_pages_bulk(ptrs, k) : buddy_arena_free_bulk(pools[id].arena, ptrs, k);
+    if (r != OK) {
+        fail("free_bulk of live blocks", r);
+    }
+    for (int i = 0; i < k; i++) {
+        model_free(&held[from[i]]);
+        last_freed = held[from[i]];
+        held[from[i]].p = NULL;
+    }
+}
+
+static void op_alloc_bytes(const trace_op_t *op, int id) {
+    uint32_t slot = op->slot;
+    int trim = op->rank & 1;
+    // 1.5 KiB to 6 MiB, mostly not a power of two pages
+    size_t n = (size_t)((op->arg & 31) + 1) * 1531 << (op->arg >> 5);
+    int run_pages = (int)((n + PAGE - 1) / PAGE);
+    int rank = run_pages == 1 ? 1 : 33 - __builtin_clz(run_pages - 1);
+    if (id == P_TEMPLATE) {
+        fail("bad alloc_bytes record", id);
+        return;
+    }
+    if (held[slot].p != NULL) {
+        skipped++;
+        return;
+    }
+    void *p = id == P_DEFAULT && trim ? alloc_bytes(n)
+              : buddy_arena_alloc_bytes(pools[id].arena, n, trim ? BUDDY_TRIM : 0);
+    if (IS_ERR(p)) {
+        if (PTR_ERR(p) != -ENOSPC || !out_of_space(op, id, rank)) {
+            fail("alloc_bytes failed with space left", PTR_ERR(p));
+        }
+        return;
+    }
+    // A trimmed run reports the rank of its first piece
+    int is_run = trim && run_pages != 1 << (rank - 1);
+    if (!take(id, p, rank, is_run ? 32 - __builtin_clz(run_pages) : rank)) return;
+    if (is_run) {
+        pool_t *m = &pools[id];
+        model_trim(m, page_of(m, p), rank, run_pages);
+        hold(slot, id, p, K_RUN, rank, run_pages, 0);
+    } else {
+        hold(slot, id, p, K_BLOCK, rank, 0, 0);
+    }
+}
+
+static void op_realloc(const trace_op_t *op) {
+    held_t *h = &held[op->slot];
+    int new_rank = op->rank;
+    if (new_rank < 1 || new_rank > MAXRANK) {
+        fail("bad realloc record", new_rank);
+        return;
+    }
+    if (h->p == NULL || h->pool == P_TEMPLATE || (h->kind != K_BLOCK && h->kind != K_RUN)) {
+        skipped++;
+        return;
+    }
+    int id = h->pool;
+    pool_t *m = &pools[id];
+    touched |= 1u << id;
+    void *q = id == P_DEFAULT ? realloc_pages(h->p, new_rank) : buddy_arena_realloc(m->arena, h->p, new_rank);
+    // Only a move allocates
+    if (q != h->p) {
+        trace_alloc(id, q, new_rank, 0);
+    }
+    // Trimmed runs are not buddy-sized and cannot be resized
+    if (h->kind == K_RUN) {
+        if (PTR_ERR(q) != -EINVAL) {
+            fail("realloc of a trimmed run", PTR_ERR(q));
+        }
+        return;
+    }
+    if (IS_ERR(q)) {
+        if (PTR_ERR(q) != -ENOSPC || model_has_space(m, new_rank)) {
+            fail("realloc failed with space left", PTR_ERR(q));
+        }
+        return;
+    }
+    int idx = page_of(m, h->p);
+    if (q == h->p) {
+        model_give(m, idx, h->rank);
+        if (!model_take(m, idx, new_rank)) {
+            fail("realloc grew over pages that are not free", idx);
+        }
+    } else {
+        if (!model_take(m, page_of(m, q), new_rank)) {
+            fail("realloc moved to a block that is not free", page_of(m, q));
+        }
+        model_give(m, idx, h->rank);
+    }
+    if (*(uint64_t *)q != STAMP(op->slot)) {
+        fail("realloc lost the contents", op->slot);
+    }
+    if (pool_query(id, q) != new_rank) {
+        fail("query_ranks of a resized block", pool_query(id, q));
+    }
+    h->p = q;
+    h->rank = new_rank;
+}
+
+static void op_alloc_small(const trace_op_t *op, int id) {
+    uint32_t slot = op->slot;
+    size_t n = 8 + (size_t)op->arg * 8;
+    int rank = small_rank(n);
+    if (id == P_TEMPLATE) {
+        fail("bad alloc_small record", id);
+        return;
+    }
+    if (held[slot].p != NULL) {
+        skipped++;
+        return;
+    }
+    pool_t *m = &pools[id];
+    void *o = id == P_DEFAULT ? alloc_small(n) : buddy_arena_alloc_small(m->arena, n);
+    if (IS_ERR(o)) {
+        if (PTR_ERR(o) != -ENOSPC || model_has_space(m, rank)) {
+            fail("alloc_small failed with space left", PTR_ERR(o));
+        }
+        return;
+    }
+    // Either a slab the model knows or a new one, carved from a free block
+    int head = slab_head(m, o, rank);
+    if (head < 0) {
+        fail("alloc_small returned an object outside the pool", 0);
+        return;
+    }
+    if (!(m->model[head] & MODEL_SLAB)) {
+        if (!model_take(m, head, rank)) {
+            fail("alloc_small started a slab on pages that are not free", head);
+            return;
+        }
+        m->model[head] |= MODEL_SLAB;
+        if (pool_query(id, m->base + (size_t)head * PAGE) != -EINVAL) {
+            fail("query_ranks of a slab page", head);
+        }
+    } else if ((m->model[head] & MODEL_RANK) != rank) {
+        fail("alloc_small returned an object of another class", head);
+        return;
+    }
+    m->slab_objects[head]++;
+    m->small_live++;
+    hold(slot, id, o, K_SMALL, rank, 0, 0);
+}
+
+// Move the shared pool to its other mapping and attach to it there; every
+// live block must survive at the same offset
+static void op_attach(void) {
+    pool_t *m = &pools[P_SHARED];
+    char *from = shared_maps[shared_at], *to = shared_maps[shared_at ^ 1];
+    size_t size = (size_t)SHARED_PAGES * PAGE;
+    if (mremap(from, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, to) == MAP_FAILED) {
+        fail("mremap", errno);
+        return;
+    }
+    // Keep the old range reserved for the move back
+    mmap(from, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    shared_at ^= 1;
+
+    buddy_arena_config_t other = {.flags = BUDDY_ARENA_META_IN_POOL, .max_rank = MAXRANK - 1};
+    if (PTR_ERR(buddy_arena_attach(to, SHARED_PAGES, &other)) != -EINVAL) {
+        fail("attach with another max_rank", 0);
+    }
+    buddy_arena_config_t cfg = {.flags = BUDDY_ARENA_META_IN_POOL};
+    buddy_arena_t *a = buddy_arena_attach(to, SHARED_PAGES, &cfg);
+    if (IS_ERR(a)) {
+        fail("buddy_arena_attach", PTR_ERR(a));
+        m->live = 0;
+        return;
+    }
+    long delta = to - from;
+    m->arena = a;
+    m->base += delta;
+    for (uint32_t i = 0; i < slots; i++) {
+        if (held[i].p != NULL && held[i].pool == P_SHARED) {
+            held[i].p = (char *)held[i].p + delta;
+        }
+    }
+    if (last_freed.p != NULL && last_freed.pool == P_SHARED) {
+        last_freed.p = (char *)last_freed.p + delta;
+    }
+}
+
+static void op_release(const trace_op_t *op, int id) {
+    pool_t *m = &pools[id];
+    int min_rank = op->rank;
+    int flags = op->arg & 1 ? BUDDY_RELEASE_LAZY : 0;
+    if (id == P_TEMPLATE || min_rank < 1 || min_rank > MAXRANK) {
+        fail("bad release record", min_rank);
+        return;
+    }
+    int r;
+    if (id == P_DEFAULT) {
+        r = buddy_trim(min_rank);
+    } else if (id == P_HUGE) {
+        r = buddy_huge_release(&huge, huge.hugetlb ? 0 : flags);
+    } else {
+        r = buddy_arena_release(m->arena, min_rank, PAGE, flags);
+    }
+    if (r < 0 || r > model_free_pages(m)) {
+        fail("release", r);
+    }
+    buddy_stats_t s;
+    buddy_arena_stats(m->arena, &s);
+    if (s.cold_bytes > s.free_bytes) {
+        fail("more cold bytes than free ones", (long)(s.cold_bytes / PAGE));
+    }
+}
+
+static void op_scan(int id) {
+    pool_t *m = &pools[id];
+    buddy_scan_t s;
+    if (id == P_TEMPLATE || buddy_arena_scan(m->arena, &s) != OK) {
+        fail("buddy_arena_scan", id);
+        return;
+    }
+    for (int rank = 1; rank <= MAXRANK; rank++) {
+        if (s.free_blocks[rank] != m->counts[rank]) {
+            fail("scan free blocks differ from the model", rank);
+        }
+    }
+    long free_pages = model_free_pages(m);
+    if (s.free_pages != free_pages || s.allocated_pages != m->pages - free_pages) {
+        fail("scan page totals differ from the model", s.free_pages);
+    }
+    if (s.largest_free_run != model_free_run(m)) {
+        fail("scan free run differs from the model", s.largest_free_run);
+    }
+}
+
+static void op_stats(int id) {
+    pool_t *m = &pools[id];
+    buddy_stats_t s;
+    if (id == P_TEMPLATE || (id == P_DEFAULT ? buddy_stats(&s) : buddy_arena_stats(m->arena, &s)) != OK) {
+        fail("buddy_arena_stats", id);
+        return;
+    }
+    // Cached blocks are free in the model, but not on the free lists yet
+    size_t free_bytes = (size_t)model_free_pages(m) * PAGE;
+    if (s.free_bytes + s.cached_bytes != free_bytes ||
+        s.allocated_bytes != (size_t)m->pages * PAGE - free_bytes) {
+        fail("stats byte totals differ from the model", (long)(s.free_bytes / PAGE));
+    }
+    if (s.cold_bytes > s.free_bytes) {
+        fail("more cold bytes than free ones", (long)(s.cold_bytes / PAGE));
+    }
+    for (int rank = 1; s.cached_bytes == 0 && rank <= MAXRANK; rank++) {
+        if (s.free_blocks[rank] != m->counts[rank]) {
+            fail("stats free blocks differ from the model", rank);
+        }
+    }
+}
+
+static void apply(const trace_op_t *op) {
+    uint32_t slot = op->slot;
+    int id = op->pool;
+    if (slot >= slots || id >= POOLS) {
+        fail("slot or pool out of range", slot);
+        return;
+    }
+    if (!pools[id].live) {
+        skipped++;
+        return;
+    }
+    touched |= 1u << id;
+
+    switch (op->op) {
+    case OP_ALLOC:
+    case OP_ALLOC_TAGGED: op_alloc(op, id); break;
+    case OP_FREE: op_free(slot); break;
+    case OP_DOUBLE_FREE: op_double_free(); break;
+    case OP_FREE_ALL:
+        for (uint32_t i = 0; i < slots; i++) {
+            if (held[i].p != NULL) {
+                op_free(i);
+                trace_sync();
+            }
+        }
+        break;
+    case OP_ALLOC_BULK: op_alloc_bulk(op, id); break;
+    case OP_FREE_BULK: op_free_bulk(op, id); break;
+    case OP_ALLOC_BYTES: op_alloc_bytes(op, id); break;
+    case OP_REALLOC: op_realloc(op); break;
+    case OP_ALLOC_SMALL: op_alloc_small(op, id); break;
+    case OP_ATTACH:
+        if (id != P_SHARED) {
+            fail("bad attach record", id);
+        } else {
+            op_attach();
+        }
+        break;
+    case OP_RELEASE: op_release(op, id); break;
+    case OP_SCAN: op_scan(id); break;
+    case OP_STATS: op_stats(id); break;
+    default: fail("unknown op", op->op);
+    }
+}
+
+static _Thread_local uint64_t rng_state;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Next op of a random trace. Occupancy drifts between nearly empty and
+// full in epochs, so the pools see both fragmentation and exhaustion, and
+// every fourth epoch ends with every pool coalescing back. Ranks are
+// geometric, each one about half as likely as the one below. Half the ops
+// go to the default pool and the rest are spread over the others; a held
+// slot is freed (now and then resized, or freed along with its neighbours)
+// on the pool it came from.
+static void generate(trace_op_t *op, long i) {
+    uint64_t x = rng(), y = rng();
+    memset(op, 0, sizeof(*op));
+    if ((i & ((1 << 18) - 1)) == (1 << 18) - 1) {
+        op->op = OP_FREE_ALL;
+        return;
+    }
+    int phase = (i >> 16) & 3;
+    uint64_t alloc_bias = phase == 0 ? 90 : phase == 1 ? 60 : phase == 2 ? 40 : 10;
+    int want_alloc = x % 100 < alloc_bias;
+
+    // Probe a few slots for one that suits the op we want
+    uint32_t slot = (x >> 32) % slots;
+    for (int k = 0; k < 8 && (held[slot].p == NULL) != want_alloc; k++) {
+        slot = (slot + 1) % slots;
+    }
+    op->slot = slot;
+
+    if (held[slot].p != NULL) {
+        int id = held[slot].pool, kind = held[slot].kind;
+        op->pool = id;
+        op->op = OP_FREE;
+        if (id != P_TEMPLATE && (kind == K_BLOCK || kind == K_RUN)) {
+            if (y % 16 == 0) {
+                op->op = OP_REALLOC;
+                op->rank = 1 + __builtin_ctzll((y >> 8) | (1ull << (MAXRANK - 1)));
+            } else if (y % 16 == 1) {
+                op->op = OP_FREE_BULK;
+                op->arg = y >> 56;
+            }
+        }
+        return;
+    }
+
+    int id = (x >> 8) & 1 ? P_DEFAULT : 1 + (int)((x >> 9) % (POOLS - 1));
+    op->pool = id;
+    op->rank = 1 + __builtin_ctzll((x >> 16) | (1ull << (MAXRANK - 1)));
+    op->arg = y >> 56;
+    int pick = (y >> 8) % 128;
+    if ((x & 63) == 0) {
+        op->op = OP_DOUBLE_FREE;
+    } else if (id == P_TEMPLATE || pick >= 50) {
+        op->op = OP_ALLOC;
+    } else if (pick < 2) {
+        // Pool-wide ops
+        static const uint8_t pool_ops[] = {OP_SCAN, OP_STATS, OP_RELEASE, OP_ATTACH};
+        op->op = pool_ops[(y >> 16) % 4];
+        if (op->op == OP_ATTACH && id != P_SHARED) {
+            op->op = OP_STATS;
+        }
+        if (op->op == OP_RELEASE) {
+            op->rank = 1 + (y >> 24) % 4;
+        }
+    } else if (pick < 12) {
+        op->op = OP_ALLOC_TAGGED;
+    } else if (pick < 20) {
+        op->op = OP_ALLOC_BULK;
+    } else if (pick < 34) {
+        op->op = OP_ALLOC_BYTES;
+        op->rank = (y >> 24) & 1;
+    } else {
+        op->op = OP_ALLOC_SMALL;
+    }
+}
+
+// Boundary cases of the other entry points, checked once on a scratch
+// arena before the trace runs
+#define EDGE_PAGES 64
+#define EDGE_RANK 7
+
+static void expect(int ok, const char *what) {
+    if (!ok) {
+        fail(what, 0);
+    }
+}
+
+static int free_pages(buddy_arena_t *a) {
+    int n = 0;
+    for (int rank = 1; rank <= EDGE_RANK; rank++) {
+        n += buddy_arena_query_page_counts(a, rank) << (rank - 1);
+    }
+    return n;
+}
+
+static void check_edges(void) {
+    // Anonymous memory, so buddy_arena_release may drop its pages
+    char *mem = mmap(NULL, (size_t)EDGE_PAGES * PAGE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buddy_arena_config_t cfg = {.max_rank = EDGE_RANK};
+    buddy_arena_t *a = buddy_arena_init_config(mem, EDGE_PAGES, &cfg);
+    size_t largest = (size_t)PAGE << (EDGE_RANK - 1);
+
+    // alloc_bytes: sizes that wrap when rounded up, or just exceed max_rank
+    expect(PTR_ERR(buddy_arena_alloc_bytes(a, (size_t)-1, BUDDY_TRIM)) == -EINVAL, "alloc_bytes(SIZE_MAX)");
+    expect(PTR_ERR(buddy_arena_alloc_bytes(a, (size_t)-PAGE, 0)) == -EINVAL, "alloc_bytes(-PAGE)");
+    expect(PTR_ERR(buddy_arena_alloc_bytes(a, largest + 1, BUDDY_TRIM)) == -EINVAL, "alloc_bytes(largest + 1)");
+    expect(PTR_ERR(buddy_arena_alloc_bytes(a, 0, 0)) == -EINVAL, "alloc_bytes(0)");
+    void *p = buddy_arena_alloc_bytes(a, largest, BUDDY_TRIM);
+    expect(!IS_ERR(p) && buddy_arena_query_ranks(a, p) == EDGE_RANK, "alloc_bytes(largest)");
+    expect(buddy_arena_free(a, p) == OK, "free of alloc_bytes(largest)");
+
+    // Small objects: a double free is refused and the object is handed out once
+    void *o1 = buddy_arena_alloc_small(a, 100);
+    void *o2 = buddy_arena_alloc_small(a, 100);
+    expect(!IS_ERR(o1) && !IS_ERR(o2) && o1 != o2, "alloc_small");
+    expect(buddy_arena_free_small(a, o1) == OK, "free_small");
+    expect(buddy_arena_free_small(a, o1) == -EINVAL, "double free_small");
+    void *o3 = buddy_arena_alloc_small(a, 100);
+    void *o4 = buddy_arena_alloc_small(a, 100);
+    expect(o3 == o1 && o4 != o1 && o4 != o2, "alloc_small after a double free");
+    expect(buddy_arena_free_small(a, (char *)o2 + 64) == -EINVAL, "free_small of an unallocated object");
+    // The slab under them is not a block of the caller's
+    void *slab = (void *)((uintptr_t)o1 & ~(uintptr_t)(PAGE - 1));
+    expect(buddy_arena_free(a, slab) == -EINVAL, "free of a slab page");
+    expect(buddy_arena_query_ranks(a, slab) == -EINVAL, "query_ranks of a slab page");
+    expect(PTR_ERR(buddy_arena_realloc(a, slab, 2)) == -EINVAL, "realloc of a slab page");
+    expect(buddy_arena_free_small(a, o2) == OK && buddy_arena_free_small(a, o3) == OK &&
+           buddy_arena_free_small(a, o4) == OK, "free_small of the rest");
+
+#ifdef BUDDY_CHECKED
+    // Tagged frees: only the current tag frees a block, and only once
+    unsigned int tag;
+    void *t = buddy_arena_alloc_tagged(a, 2, &tag);
+    expect(buddy_arena_free(a, (char *)t + PAGE) == -EINVAL, "free of an interior page");
+    expect(buddy_arena_free_tagged(a, t, tag + 1) == -EINVAL, "free_tagged with a stale tag");
+    expect(buddy_arena_free_tagged(a, t, tag) == OK, "free_tagged");
+    expect(buddy_arena_free_tagged(a, t, tag) == -EINVAL, "double free_tagged");
+#endif
+
+    // Release: every free page goes back, one-page blocks included, and a
+    // released block comes back zeroed
+    int idle = free_pages(a);
+    void *b1 = buddy_arena_alloc(a, 1);
+    void *b2 = buddy_arena_alloc(a, 1);
+    memset(b1, 0xa5, PAGE);
+    expect(buddy_arena_free(a, b1) == OK, "free before release");
+    expect(buddy_arena_release(a, 1, PAGE, 0) == idle - 1, "release of every free page");
+    expect(buddy_arena_release(a, 1, PAGE, 0) == 0, "release of cold pages");
+    expect(buddy_arena_check(a) == 0, "scratch arena consistent after release");
+    void *b3 = buddy_arena_alloc(a, 1);
+    expect(!IS_ERR(b3) && *(volatile char *)b3 == 0, "alloc of a released page");
+    expect(buddy_arena_free(a, b2) == OK && buddy_arena_free(a, b3) == OK && free_pages(a) == idle,
+           "free after release");
+
+    expect(buddy_arena_check(a) == 0, "scratch arena consistent");
+    buddy_arena_destroy(a);
+    munmap(mem, (size_t)EDGE_PAGES * PAGE);
+}
+
+#ifdef BUDDY_THREAD_SAFE
+#define THREAD_SLOTS 64
+#define RING_SIZE 256
+
+static int handoff;
+static long thread_ops;
+static void *ring[RING_SIZE];       // Blocks on their way from thread 0 to the freers
+static int ring_rank[RING_SIZE];
+static int allocator_done;
+
+// Mark a held block with its owner and rank at both ends
+static void stamp(void *p, int rank, uint64_t owner) {
+    uint64_t *first = p;
+    uint64_t *last = (uint64_t *)((char *)p + ((size_t)PAGE << (rank - 1))) - 1;
+    *first = owner << 8 | rank;
+    *last = ~*first;
+}
+
+// Check a block's stamp and return it
+static void release(void *p, int rank, uint64_t owner) {
+    uint64_t *first = p;
+    uint64_t *last = (uint64_t *)((char *)p + ((size_t)PAGE << (rank - 1))) - 1;
+    if (*first != (owner << 8 | rank) || *last != ~*first) {
+        fail("block clobbered while held", page_of(&pools[P_DEFAULT], p));
+    }
+    int r = return_pages(p);
+    if (r != OK) {
+        fail("return_pages of a live block", r);
+    }
+}
+
+static int random_rank(void) {
+    return 1 + __builtin_ctzll((rng() >> 8) | (1ull << 5));
+}
+
+static void *alloc_stamped(int rank, uint64_t owner) {
+    void *p = alloc_pages(rank);
+    if (IS_ERR(p)) {
+        if (PTR_ERR(p) != -ENOSPC) {
+            fail("alloc_pages", PTR_ERR(p));
+        }
+        return NULL;
+    }
+    if (query_ranks(p) != rank) {
+        fail("query_ranks of a new block", query_ranks(p));
+    }
+    stamp(p, rank, owner);
+    return p;
+}
+
+// Allocate and free blocks of a thread's own, looking up random pages of
+// the pool on the way
+static void churn(uint64_t owner) {
+    void *mine[THREAD_SLOTS] = {0};
+    int ranks[THREAD_SLOTS];
+    for (long i = 0; i < thread_ops; i++) {
+        int k = rng() % THREAD_SLOTS;
+        if (mine[k] != NULL) {
+            release(mine[k], ranks[k], owner);
+            mine[k] = NULL;
+        } else {
+            ranks[k] = random_rank();
+            mine[k] = alloc_stamped(ranks[k], owner);
+        }
+        int r = query_ranks((char *)pool + (size_t)(rng() % pages) * PAGE);
+        if (r < 1 || r > MAXRANK) {
+            fail("query_ranks of a pool page", r);
+        }
+    }
+    for (int k = 0; k < THREAD_SLOTS; k++) {
+        if (mine[k] != NULL) {
+            release(mine[k], ranks[k], owner);
+        }
+    }
+}
+
+// Thread 0 of -H: fill free ring entries with new blocks
+static void hand_out(void) {
+    for (long i = 0; i < thread_ops * threads; i++) {
+        int k = rng() % RING_SIZE;
+        if (__atomic_load_n(&ring[k], __ATOMIC_ACQUIRE) != NULL) {
+            sched_yield();
+            continue;
+        }
+        int rank = random_rank();
+        void *p = alloc_stamped(rank, 0);
+        if (p != NULL) {
+            ring_rank[k] = rank;
+            __atomic_store_n(&ring[k], p, __ATOMIC_RELEASE);
+        } else {
+            sched_yield();
+        }
+    }
+    __atomic_store_n(&allocator_done, 1, __ATOMIC_RELEASE);
+}
+
+// The other threads of -H: free whatever shows up in the ring until thread
+// 0 is done and the ring is empty
+static void take_in(void) {
+    for (;;) {
+        int done = __atomic_load_n(&allocator_done, __ATOMIC_ACQUIRE);
+        int found = 0;
+        for (int k = 0; k < RING_SIZE; k++) {
+            void *p = __atomic_exchange_n(&ring[k], NULL, __ATOMIC_ACQ_REL);
+            if (p != NULL) {
+                release(p, ring_rank[k], 0);
+                found = 1;
+            }
+        }
+        if (done && !found) break;
+        if (!found) sched_yield();
+    }
+}
+
+static void *worker(void *arg) {
+    long id = (long)arg;
+    rng_state = (rng_state ^ (uint64_t)(id + 1) * 0x9e3779b97f4a7c15ull) | 1;
+    if (!handoff) {
+        churn(id + 1);
+    } else if (id == 0) {
+        hand_out();
+    } else {
+        take_in();
+    }
+    return NULL;
+}
+
+static void run_threads(long ops) {
+    pthread_t tids[threads];
+    thread_ops = ops / threads;
+    uint64_t seed = rng_state;
+    for (long i = 0; i < threads; i++) {
+        rng_state = seed;    // Workers derive their seeds from it
+        if (pthread_create(&tids[i], NULL, worker, (void *)i) != 0) {
+            perror("pthread_create");
+            exit(2);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    op_index = thread_ops * threads;
+}
+#endif
+
+// Set up a pool's model over the pages an arena manages within [from,
+// from + span pages). Arenas with their metadata in the pool start past
+// it, and query_ranks refuses the metadata pages.
+static void model_setup(int id, const char *name, buddy_arena_t *a, char *from, int span, int natural) {
+    pool_t *m = &pools[id];
+    m->name = name;
+    if (IS_ERR(a)) {
+        fprintf(stderr, "%s pool unavailable (%ld), skipping it\n", name, PTR_ERR(a));
+        return;
+    }
+    int first = 0;
+    while (first < span && (a == NULL ? 1 : buddy_arena_query_ranks(a, from + (size_t)first * PAGE)) < 1) {
+        first++;
+    }
+    int n = 0;
+    while (first + n < span && (a == NULL ? 1 : buddy_arena_query_ranks(a, from + (size_t)(first + n) * PAGE)) >= 1) {
+        n++;
+    }
+    m->arena = a;
+    m->base = from + (size_t)first * PAGE;
+    m->pages = n;
+    m->off = natural ? (int)(((uintptr_t)m->base / PAGE) & ((1u << (MAXRANK - 1)) - 1)) : 0;
+    m->model = malloc(n);
+    m->slab_objects = calloc(n, sizeof(int));
+    if (n == 0 || m->model == NULL || m->slab_objects == NULL) {
+        fprintf(stderr, "%s pool unavailable, skipping it\n", name);
+        return;
+    }
+    model_init(m);
+    m->live = 1;
+}
+
+static void *map_pool(int pgcount, int prot) {
+    void *p = mmap(NULL, (size_t)pgcount * PAGE, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void setup_pools(void) {
+    init_page(pool, pages);
+    model_setup(P_DEFAULT, "default", buddy_default_arena(), pool, pages, 0);
+
+    buddy_arena_config_t cfg = {.flags = BUDDY_ARENA_META_IN_POOL};
+    shared_maps[0] = map_pool(SHARED_PAGES, PROT_READ | PROT_WRITE);
+    shared_maps[1] = map_pool(SHARED_PAGES, PROT_NONE);
+    model_setup(P_SHARED, "shared",
+                shared_maps[0] && shared_maps[1] ? buddy_arena_init_config(shared_maps[0], SHARED_PAGES, &cfg)
+                                                 : ERR_PTR(-ENOMEM),
+                shared_maps[0], SHARED_PAGES, 0);
+
+    int r = buddy_huge_init(&huge, HUGE_PAGES, HUGE_SHIFT);
+    model_setup(P_HUGE, "huge", r == OK ? huge.arena : ERR_PTR(r), huge.base, (int)(huge.size / PAGE), 1);
+
+    // Nodes never refuse a steal, so a NUMA alloc fails only when both are full
+    buddy_numa_config_t numa = {.nodes = 2, .pages_per_node = NUMA_PAGES};
+    r = buddy_numa_init(&numa);
+    for (int node = 0; node < 2; node++) {
+        buddy_arena_t *a = r == OK ? buddy_numa_arena(node) : ERR_PTR(r);
+        char *from = IS_ERR(a) ? NULL : (char *)((uintptr_t)a & ~(uintptr_t)(PAGE - 1));
+        model_setup(P_NUMA0 + node, node ? "numa1" : "numa0", a, from, NUMA_PAGES, 1);
+    }
+
+    char *mem = map_pool(TEMPLATE_PAGES, PROT_READ | PROT_WRITE);
+    r = mem == NULL ? -ENOMEM : tmpl_init(&tmpl_arena, mem, TEMPLATE_PAGES);
+    model_setup(P_TEMPLATE, "template", r == OK ? NULL : ERR_PTR(r), mem, TEMPLATE_PAGES, 0);
+}
+
+int main(int argc, char **argv) {
+    long ops = 1000000;
+    uint64_t seed = 1;
+    const char *record = NULL, *replay = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "n:p:s:c:w:r:t:H")) != -1) {
+        switch (c) {
+        case 'n': ops = atol(optarg); break;
+        case 'p': pages = atoi(optarg); break;
+        case 's': seed = strtoull(optarg, NULL, 0); break;
+        case 'c': check_every = atol(optarg); break;
+        case 'w': record = optarg; break;
+        case 'r': replay = optarg; break;
+#ifdef BUDDY_THREAD_SAFE
+        case 't': threads = atoi(optarg); break;
+        case 'H': handoff = 1; break;
+#endif
+        default:
+            fprintf(stderr, "usage: %s [-n ops] [-p pages] [-s seed] [-c check_every] "
+                    "[-w file] [-r file] [-t threads [-H]]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    FILE *in = NULL, *out = NULL;
+    trace_header_t header = {TRACE_MAGIC, TRACE_VERSION, 0, 0};
+    if (replay != NULL) {
+        in = fopen(replay, "rb");
+        if (in == NULL || fread(&header, sizeof(header), 1, in) != 1 ||
+            header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+            fprintf(stderr, "%s: not a trace log\n", replay);
+            return 2;
+        }
+        pages = header.pages;
+    }
+#ifdef BUDDY_THREAD_SAFE
+    if (threads < 0 || (threads > 0 && (record != NULL || replay != NULL)) ||
+        (handoff && threads < 2)) {
+        fprintf(stderr, "bad arguments\n");
+        return 2;
+    }
+#endif
+    if (ops < 0 || pages < 1 || check_every < 1) {
+        fprintf(stderr, "bad arguments\n");
+        return 2;
+    }
+    slots = replay != NULL ? header.slots : (uint32_t)(pages / 4 > 1024 ? pages / 4 : 1024);
+
+    // Anonymous memory, so buddy_trim may drop its pages
+    pool = map_pool(pages, PROT_READ | PROT_WRITE);
+    held = calloc(slots, sizeof(held_t));
+    if (pool == NULL || held == NULL) {
+        perror("malloc");
+        return 2;
+    }
+
+    if (record != NULL) {
+        out = fopen(record, "wb");
+        header.pages = pages;
+        header.slots = slots;
+        if (out == NULL || fwrite(&header, sizeof(header), 1, out) != 1) {
+            perror(record);
+            return 2;
+        }
+    }
+
+    check_edges();
+    setup_pools();
+    if (!pools[P_DEFAULT].live) {
+        return 2;
+    }
+    rng_state = seed ? seed : 1;
+
+    trace_start();
+    uint64_t t0 = now_ns();
+    trace_op_t op;
+#ifdef BUDDY_THREAD_SAFE
+    if (threads > 0) {
+        run_threads(ops);
+    } else
+#endif
+    for (op_index = 0; replay != NULL || op_index < ops; op_index++) {
+        if (in != NULL) {
+            if (fread(&op, sizeof(op), 1, in) != 1) break;
+        } else {
+            generate(&op, op_index);
+        }
+        if (out != NULL && fwrite(&op, sizeof(op), 1, out) != 1) {
+            perror(record);
+            return 2;
+        }
+        if (op.op == OP_FREE_ALL) {
+            touched = (1u << POOLS) - 1;
+        }
+        apply(&op);
+        if ((op_index + 1) % check_every == 0) {
+            for (int id = 0; id < POOLS; id++) {
+                if (touched & (1u << id)) {
+                    check_pool(id);
+                }
+            }
+            touched = 0;
+        }
+        trace_sync();
+        if (failures > 10) break;
+    }
+    trace_stop();
+    for (int id = 0; id < POOLS; id++) {
+        check_pool(id);
+    }
+    double secs = (now_ns() - t0) / 1e9;
+
+    if (in != NULL) fclose(in);
+    if (out != NULL && fclose(out) != 0) {
+        perror(record);
+        return 2;
+    }
+
+    printf("%ld ops (%ld skipped) on %d pages in %.2f s (%.2f Mops/s, counts checked every %ld): %s\n",
+           op_index, skipped, pages, secs, op_index / secs / 1e6, check_every,
+           failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}